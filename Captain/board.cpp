@@ -479,4 +479,88 @@ namespace board
         }
         return update;
     }
-}
\ No newline at end of file
+
+    std::uint64_t Board::initialPawnHash(const board::QBB& b)
+    {
+        std::uint64_t inithash = b.isWhiteToPlay() ? Tables::tt.wToMove : 0;
+        aux::GetNextBit<board::square> pawn(b.getPawns());
+        while (pawn())
+        {
+            const auto i = pawn.next;
+            const bool mine = b.getPieceType(i) & 1;
+            if (b.isWhiteToPlay())
+                inithash ^= (mine ? Tables::tt.whitePSQT : Tables::tt.blackPSQT)[constants::pawnCode - 1][i];
+            else
+                inithash ^= (mine ? Tables::tt.blackPSQT : Tables::tt.whitePSQT)[constants::pawnCode - 1][aux::flip(i)];
+        }
+        return inithash;
+    }
+
+    // pawn key counterpart of incrementalUpdate, a null move only changes the side to move
+    std::uint64_t Board::pawnUpdate(Move m, const board::QBB& old)
+    {
+        std::uint64_t update = Tables::tt.wToMove;
+        if (m == 0)
+            return update;
+
+        const auto* myPSQT = &Tables::tt.whitePSQT;
+        const auto* oppPSQT = &Tables::tt.blackPSQT;
+        auto from = static_cast<board::square>(board::getMoveInfo<constants::fromMask>(m));
+        auto to = static_cast<board::square>(board::getMoveInfo<constants::toMask>(m));
+        const bool pawnMoved = (old.getPieceType(from) >> 1) == constants::pawnCode;
+        const bool pawnCaptured = (old.getPieceType(to) >> 1) == constants::pawnCode;
+
+        if (!old.isWhiteToPlay())
+        {
+            myPSQT = &Tables::tt.blackPSQT;
+            oppPSQT = &Tables::tt.whitePSQT;
+            from = static_cast<board::square>(aux::flip(from));
+            to = static_cast<board::square>(aux::flip(to));
+        }
+
+        constexpr auto pawnIdx = constants::pawnCode - 1;
+        if (pawnMoved)
+        {
+            update ^= (*myPSQT)[pawnIdx][from];
+            if (!board::isPromo(m))
+                update ^= (*myPSQT)[pawnIdx][to];
+        }
+        if (pawnCaptured)
+            update ^= (*oppPSQT)[pawnIdx][to];
+        if (board::getMoveInfo<constants::moveTypeMask>(m) == constants::enPCap)
+            update ^= (*oppPSQT)[pawnIdx][old.isWhiteToPlay() ? to - 8 : to + 8];
+        return update;
+    }
+
+    MaterialKey initialMaterialKey(const QBB& b)
+    {
+        MaterialKey key = 0;
+        const std::array<Bitboard, 5> pieces = { b.getPawns(), b.getKnights(), b.getBishops(), b.getRooks(), b.getQueens() };
+        for (unsigned i = 0; i != pieces.size(); ++i)
+        {
+            key += static_cast<MaterialKey>(_popcnt64(b.my(pieces[i]))) << materialShift(i, true);
+            key += static_cast<MaterialKey>(_popcnt64(b.their(pieces[i]))) << materialShift(i, false);
+        }
+        return key;
+    }
+
+    // the key after m, seen from the side that moves next
+    MaterialKey Board::materialUpdate(Move m, const board::QBB& old, MaterialKey key)
+    {
+        if (m != 0)
+        {
+            const auto to = board::getMoveToSq(m);
+            if (board::getMoveInfo<constants::moveTypeMask>(m) == constants::enPCap)
+                key -= 1ULL << materialShift(pawns, false);
+            else if (old.getPieceCode(to))
+                key -= 1ULL << materialShift(old.getPieceCodeIdx(to), false);
+
+            if (board::isPromo(m))
+            {
+                key -= 1ULL << materialShift(pawns, true);
+                key += 1ULL << materialShift(board::getPromoPiece(m), true);
+            }
+        }
+        return flipMaterialKey(key);
+    }
+}
@@ -520,6 +520,29 @@ namespace board
         std::array<std::optional<Bitboard>, 12> attackmaps;
 
     };
+
+    // Piece counts of both sides packed 4 bits per piece type, the side to move's
+    // counts in the low 20 bits. Equal keys mean equal material, so it keys the
+    // material table without collisions.
+    using MaterialKey = std::uint64_t;
+
+    constexpr unsigned materialShift(unsigned pieceIdx, bool mine) noexcept
+    {
+        return 4 * pieceIdx + (mine ? 0 : 20);
+    }
+
+    constexpr unsigned materialCount(MaterialKey key, unsigned pieceIdx, bool mine) noexcept
+    {
+        return (key >> materialShift(pieceIdx, mine)) & 0xF;
+    }
+
+    constexpr MaterialKey flipMaterialKey(MaterialKey key) noexcept
+    {
+        return ((key & 0xFFFFFULL) << 20) | (key >> 20);
+    }
+
+    MaterialKey initialMaterialKey(const QBB&);
+
     // TODO store attack maps per position
     struct Board
     {
@@ -528,11 +551,16 @@ namespace board
         {
             return boards.size()
                 && boards.size() == hashes.size()
+                && boards.size() == pawnHashes.size()
+                && boards.size() == materialKeys.size()
                 && boards.size() == moves.size() + 1;
         }
     public:
         std::vector<QBB> boards;
         std::vector<Hash> hashes;
+        // keys of the pawn structure and side to move, for the pawn hash table
+        std::vector<Hash> pawnHashes;
+        std::vector<MaterialKey> materialKeys;
         std::vector<Move> moves;
 
         operator const QBB&() const
@@ -552,18 +580,24 @@ namespace board
         {
             boards.push_back(b);
             hashes.push_back(initialHash(b));
+            pawnHashes.push_back(initialPawnHash(b));
+            materialKeys.push_back(initialMaterialKey(b));
         }
 
         Board(std::string s, bool b = true)
         {
             boards.emplace_back(s, b);
             hashes.push_back(initialHash(boards.back()));
+            pawnHashes.push_back(initialPawnHash(boards.back()));
+            materialKeys.push_back(initialMaterialKey(boards.back()));
         }
 
         Board(std::vector<Move> m)
         {
             boards.emplace_back("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
             hashes.push_back(initialHash(boards.back()));
+            pawnHashes.push_back(initialPawnHash(boards.back()));
+            materialKeys.push_back(initialMaterialKey(boards.back()));
             for (auto i : m)
             {
                 makeMove(i);
@@ -576,18 +610,23 @@ namespace board
         {
             assert(valid());
             moves.push_back(m);
+            materialKeys.push_back(materialUpdate(m, boards.back(), materialKeys.back()));
             boards.push_back(boards.back());
             if (m != 0)
             {
                 boards.back().makeMove(m);
                 hashes.push_back(hashes.back() ^ incrementalUpdate(m, boards[boards.size() - 2], boards.back()));
+                pawnHashes.push_back(pawnHashes.back() ^ pawnUpdate(m, boards[boards.size() - 2]));
             }
             else
             {
                 boards.back().doNullMove();
                 hashes.push_back(hashes.back() ^ nullUpdate(boards[boards.size() - 2]));
+                pawnHashes.push_back(pawnHashes.back() ^ pawnUpdate(m, boards[boards.size() - 2]));
             }
             assert(hashes.back() == initialHash(boards.back()));
+            assert(pawnHashes.back() == initialPawnHash(boards.back()));
+            assert(materialKeys.back() == initialMaterialKey(boards.back()));
         }
 
         void unmakeMove(Move m)
@@ -597,12 +636,17 @@ namespace board
             assert(valid());
             moves.pop_back();
             hashes.pop_back();
+            pawnHashes.pop_back();
+            materialKeys.pop_back();
             boards.pop_back();
         }
 
         std::uint64_t initialHash(const board::QBB&);
         std::uint64_t incrementalUpdate(Move, const board::QBB&, const board::QBB&);
         std::uint64_t nullUpdate(const board::QBB&);
+        std::uint64_t initialPawnHash(const board::QBB&);
+        std::uint64_t pawnUpdate(Move, const board::QBB&);
+        static MaterialKey materialUpdate(Move, const board::QBB&, MaterialKey);
     };
 
     // valid position = won't cause any bugs when we use it
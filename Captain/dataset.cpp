@@ -0,0 +1,135 @@
+/*
+Copyright 2022-2023, Narbeh Mouradian
+
+Captain is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Captain is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <fstream>
+#include <cstring>
+
+#include "dataset.hpp"
+
+namespace dataset
+{
+    bool write(const std::string& filename, std::span<const Record> records)
+    {
+        std::ofstream file{ filename, std::ios::binary };
+        if (!file)
+            return false;
+
+        Header header;
+        header.count = records.size();
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(records.data()), records.size_bytes());
+        return static_cast<bool>(file);
+    }
+
+    MappedDataset::MappedDataset(const std::string& filename)
+    {
+#if defined(_WIN32)
+        file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            file = nullptr;
+            return;
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart < static_cast<LONGLONG>(sizeof(Header)))
+        {
+            close();
+            return;
+        }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping)
+        {
+            close();
+            return;
+        }
+        view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        viewSize = static_cast<std::size_t>(size.QuadPart);
+#else
+        file = open(filename.c_str(), O_RDONLY);
+        if (file == -1)
+            return;
+        struct stat st;
+        if (fstat(file, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(Header)))
+        {
+            close();
+            return;
+        }
+        viewSize = static_cast<std::size_t>(st.st_size);
+        view = mmap(nullptr, viewSize, PROT_READ, MAP_PRIVATE, file, 0);
+        if (view == MAP_FAILED)
+            view = nullptr;
+        else
+            madvise(view, viewSize, MADV_SEQUENTIAL);
+#endif
+        if (!view)
+        {
+            close();
+            return;
+        }
+
+        const Header expected;
+        Header header;
+        std::memcpy(&header, view, sizeof(header));
+        const std::size_t available = (viewSize - sizeof(Header)) / sizeof(Record);
+        if (header.magic != expected.magic || header.version != expected.version
+            || header.recordSize != expected.recordSize || header.count > available)
+        {
+            close();
+            return;
+        }
+
+        // the header is a multiple of the records' alignment and views are page aligned
+        records = reinterpret_cast<const Record*>(static_cast<const char*>(view) + sizeof(Header));
+        count = static_cast<std::size_t>(header.count);
+    }
+
+    void MappedDataset::close() noexcept
+    {
+#if defined(_WIN32)
+        if (view)
+            UnmapViewOfFile(view);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file)
+            CloseHandle(file);
+        mapping = nullptr;
+        file = nullptr;
+#else
+        if (view)
+            munmap(view, viewSize);
+        if (file != -1)
+            ::close(file);
+        file = -1;
+#endif
+        view = nullptr;
+        viewSize = 0;
+        records = nullptr;
+        count = 0;
+    }
+}
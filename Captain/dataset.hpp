@@ -0,0 +1,110 @@
+/*
+Copyright 2022-2023, Narbeh Mouradian
+
+Captain is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Captain is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef DATASET_H
+#define DATASET_H
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <string>
+#include <span>
+#include <type_traits>
+
+#include "board.hpp"
+
+namespace dataset
+{
+    // One scored training position as stored on disk: the QBB's words, which include the
+    // castling rights, en passant square and fifty move counter, then the game result.
+    struct Record
+    {
+        std::uint64_t side = 0;
+        std::uint64_t pbq = 0;
+        std::uint64_t nbk = 0;
+        std::uint64_t rqk = 0;
+        std::uint64_t epc = 0;
+        float result = 0;
+        std::uint32_t reserved = 0;
+
+        Record() {}
+        Record(const board::QBB& b, double score)
+            : side(b.side), pbq(b.pbq), nbk(b.nbk), rqk(b.rqk), epc(b.epc), result(static_cast<float>(score)) {}
+
+        board::QBB position() const
+        {
+            board::QBB b;
+            b.side = side;
+            b.pbq = pbq;
+            b.nbk = nbk;
+            b.rqk = rqk;
+            b.epc = epc;
+            return b;
+        }
+    };
+
+    static_assert(sizeof(Record) == 48 && std::is_trivially_copyable_v<Record>);
+
+    // Files start with this header, little-endian, followed by count records without padding
+    struct Header
+    {
+        std::array<char, 8> magic = { 'C', 'a', 'p', 't', 'D', 'a', 't', 'a' };
+        std::uint32_t version = 1;
+        std::uint32_t recordSize = sizeof(Record);
+        std::uint64_t count = 0;
+    };
+
+    static_assert(sizeof(Header) == 24 && std::is_trivially_copyable_v<Header>);
+
+    // Writes the records as a record file, returns false if the file can't be written
+    bool write(const std::string& filename, std::span<const Record> records);
+
+    // A record file mapped into memory read only. Records are read where they lie in the file,
+    // so opening costs nothing per position. A file that can't be mapped or doesn't start with
+    // a matching header leaves the dataset empty and false.
+    class MappedDataset
+    {
+        const Record* records = nullptr;
+        std::size_t count = 0;
+        void* view = nullptr;
+        std::size_t viewSize = 0;
+#if defined(_WIN32)
+        void* file = nullptr;
+        void* mapping = nullptr;
+#else
+        int file = -1;
+#endif
+        void close() noexcept;
+    public:
+        explicit MappedDataset(const std::string& filename);
+        ~MappedDataset() { close(); }
+
+        explicit operator bool() const noexcept { return records != nullptr; }
+        std::size_t size() const noexcept { return count; }
+        const Record& operator[](std::size_t i) const noexcept { return records[i]; }
+        const Record* begin() const noexcept { return records; }
+        const Record* end() const noexcept { return records + count; }
+        std::span<const Record> span() const noexcept { return { records, count }; }
+
+        MappedDataset(const MappedDataset&) = delete;
+        MappedDataset& operator=(const MappedDataset&) = delete;
+        MappedDataset(MappedDataset&&) = delete;
+        MappedDataset& operator=(MappedDataset&&) = delete;
+    };
+}
+#endif
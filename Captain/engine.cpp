@@ -27,6 +27,13 @@ along with this program. If not, see <https://www.gnu.org/licenses/>.
 #include <sstream>
 #include <cassert>
 #include <ranges>
+#include <cmath>
+#include <array>
+#include <functional>
+#include <vector>
+#include <thread>
+#include <iterator>
+#include <atomic>
 
 #include "engine.hpp"
 #include "board.hpp"
@@ -44,10 +51,10 @@ namespace engine
         return eval;
     }
 
-    std::string Engine::getPVuciformat(board::QBB b)
+    std::string Engine::getPVuciformat(board::QBB b, const PrincipalVariation& pv)
     {
         std::ostringstream PVString;
-        for (auto& i : MainPV)
+        for (auto& i : pv)
         {
             PVString << move2uciFormat(b, i) << " ";
             b.makeMove(i);
@@ -64,12 +71,20 @@ namespace engine
     {
         if (!settings.quiet)
         {
-            engine_out << "info depth " << currIDdepth << " "
-                << "score cp " << eval << " "
-                << "time " << elapsed().count() << " "
-                << "nodes " << nodes << " "
-                << "nps " << nodes / std::max(aux::castsec(elapsed()).count(), 1LL) << " "
-                << "pv " << getPVuciformat(b) << std::endl;
+            const std::size_t lines = std::min(settings.multiPV, rootMoves.size());
+            for (std::size_t i = 0; i != lines; ++i)
+            {
+                engine_out << "info depth " << currIDdepth << " ";
+                if (settings.multiPV > 1)
+                {
+                    engine_out << "multipv " << i + 1 << " ";
+                }
+                engine_out << "score " << score2uciFormat(rootMoves[i].score) << " "
+                    << "time " << elapsed().count() << " "
+                    << "nodes " << nodes << " "
+                    << "nps " << nodes / std::max(aux::castsec(elapsed()).count(), 1LL) << " "
+                    << "pv " << getPVuciformat(b, rootMoves[i].pv) << std::endl;
+            }
             engine_out.emit();
         }
     }
@@ -91,6 +106,16 @@ namespace engine
         return line2string(moves);
     }
 
+    std::string Engine::score2uciFormat(Eval e)
+    {
+        if (e >= mateBound)
+            return "mate " + std::to_string((mateValue - e + 1) / 2);
+        else if (e <= -mateBound)
+            return "mate " + std::to_string(-(mateValue + e) / 2);
+        else
+            return "cp " + std::to_string(e);
+    }
+
     std::size_t Engine::ply() const
     {
         return b.boards.size() - initialPos;
@@ -136,43 +161,47 @@ namespace engine
         return cnt >= 3;
     }
 
-    bool Engine::insufficientMaterial(const board::QBB& b) const
+    bool Engine::insufficientMaterial(const board::Board& b) const
     {
-        switch (_popcnt64(b.getOccupancy()))
-        {
-        case 0:
-        case 1:
-        case 2:
-            // Only kings
+        using board::materialCount;
+        const auto key = b.materialKeys.back();
+        auto count = [key](unsigned pieceIdx) { return materialCount(key, pieceIdx, true) + materialCount(key, pieceIdx, false); };
+
+        if (count(board::pawns) || count(board::rooks) || count(board::queens))
+            return false;
+
+        const auto minors = count(board::knights) + count(board::bishops);
+        if (minors <= 1)
             return true;
-        case 3:
-            // Two of the pieces are kings, so presence of minor piece
-            // indicates that the third piece is a minor piece
-            return b.getKnights() | b.getBishops();
-        case 4:
-        {
-            const auto myBishops = b.my(b.getBishops());
-            const auto theirBishops = b.their(b.getBishops());
-            const auto bishops = b.getBishops();
-            if (myBishops && theirBishops)
-            {
-                if (!(constants::whiteSquares & bishops) != !(constants::blackSquares & bishops))
-                {
-                    return true;
-                }
-                else
-                {
-                    return false;
-                }
-            }
-            else
-            {
-                return false;
-            }
+
+        // one bishop each, on squares of the same colour
+        if (minors == 2 && materialCount(key, board::bishops, true) == 1 && materialCount(key, board::bishops, false) == 1)
+        {
+            const board::QBB& position = b;
+            const auto bishops = position.getBishops();
+            return !(constants::whiteSquares & bishops) != !(constants::blackSquares & bishops);
         }
-        default:
-            return false;
+        return false;
+    }
+
+    Eval Engine::cachedEvaluate(Eval alpha, Eval beta)
+    {
+        const Hash key = b.hashes.back();
+        auto& entry = evalCache[key];
+        ++evalCache.probes;
+        if (entry.key == key)
+        {
+            ++evalCache.hits;
+            return entry.eval;
+        }
+        bool lazy = false;
+        const Eval e = network ? (*network)(b, accumulators) : evaluate(b, pawnTable, materialTable, alpha, beta, lazy);
+        if (!lazy)
+        {
+            entry.eval = e;
+            entry.key = key;
         }
+        return e;
     }
 
     bool Engine::isPVNode(Eval alpha, Eval beta)
@@ -180,23 +209,111 @@ namespace engine
         return alpha + 1 != beta;
     }
 
-    int Engine::LMR(std::size_t i, const board::QBB& before, Move m, const board::QBB& after, int currDepth, bool PV, bool isKiller)
+    SearchParams searchParams;
+
+    namespace
     {
-        if (moves::isInCheck(before)
-            || moves::isInCheck(after)
-            || currDepth < 3
-            || PV
-            || isKiller
-            || before.isCapture(m)
-            || board::isPromo(m)
-            || i < 4)
+        std::array<std::array<int, 64>, 64> reductions;
+        std::array<std::array<int, 64>, 2> lateMoveCounts;
+
+        int historyBonus(int depth)
         {
-            return 0;
+            return std::min(32 * depth * depth, Tables::HistoryTable::maxHistory / 8);
         }
-        else
+
+        // mate scores are stored relative to the node rather than the root,
+        // so an entry stays correct when the position is reached at another ply
+        Eval valueToTT(Eval e, std::size_t ply)
         {
-            return ply() >= 6 ? 2 : 1; 
+            if (e >= mateBound)
+                return e + static_cast<Eval>(ply);
+            if (e <= -mateBound)
+                return e - static_cast<Eval>(ply);
+            return e;
         }
+
+        Eval valueFromTT(Eval e, std::size_t ply)
+        {
+            if (e >= mateBound)
+                return e - static_cast<Eval>(ply);
+            if (e <= -mateBound)
+                return e + static_cast<Eval>(ply);
+            return e;
+        }
+
+        [[maybe_unused]] const bool searchTablesReady = (initSearchTables(), true);
+
+        // a thread's engine for EnginePool, pool is the id of the pool that set it up last
+        struct PooledEngine
+        {
+            Tables::TTable tt{ EnginePool::tableSize };
+            Engine engine;
+            std::uint64_t pool = 0;
+
+            PooledEngine() { engine.setTable(tt); }
+        };
+
+        std::atomic<std::uint64_t> poolCount = 0;
+    }
+
+    EnginePool::EnginePool(const eval::Evaluator& e, SearchSettings ss)
+        : evaluator(e), settings(std::move(ss)), id(++poolCount) {}
+
+    Engine& EnginePool::engine()
+    {
+        thread_local PooledEngine pooled;
+        if (pooled.pool != id)
+        {
+            pooled.engine.setEvaluator(evaluator);
+            pooled.engine.setSettings(settings);
+            pooled.tt.clear();
+            pooled.pool = id;
+        }
+        // entries of earlier positions stay probeable but are replaced first
+        pooled.tt.nextGeneration();
+        pooled.engine.newGame();
+        return pooled.engine;
+    }
+
+    void initSearchTables()
+    {
+        for (std::size_t d = 1; d != reductions.size(); ++d)
+        {
+            for (std::size_t i = 1; i != reductions[d].size(); ++i)
+            {
+                reductions[d][i] = static_cast<int>(searchParams.lmrBase + std::log(d) * std::log(i) / searchParams.lmrDivisor);
+            }
+        }
+        for (int d = 0; d != static_cast<int>(lateMoveCounts[0].size()); ++d)
+        {
+            lateMoveCounts[0][d] = (searchParams.lmpBase + d * d) / 2;
+            lateMoveCounts[1][d] = searchParams.lmpBase + d * d;
+        }
+    }
+
+    int Engine::LMR(std::size_t i, const board::QBB& before, Move m, const board::QBB& after, int currDepth, bool PV, bool isKiller, bool improving)
+    {
+        if (currDepth < 3
+            || i < 2
+            || before.isCapture(m)
+            || board::isPromo(m))
+        {
+            return 0;
+        }
+
+        int reduction = reductions[std::min<std::size_t>(currDepth, 63)][std::min<std::size_t>(i, 63)];
+        if (PV)
+            --reduction;
+        if (isKiller)
+            --reduction;
+        if (!improving)
+            ++reduction;
+        if (moves::isInCheck(before) || moves::isInCheck(after))
+            --reduction;
+        reduction -= historyHeuristic.getHistoryScore(before.getPieceCodeIdx(board::getMoveFromSq(m)), board::getMoveToSq(m))
+            / searchParams.lmrHistoryDivisor;
+
+        return std::clamp(reduction, 0, currDepth - 2);
     }
 
     void Engine::uciUpdate()
@@ -219,7 +336,13 @@ namespace engine
     bool Engine::shouldStop() noexcept
     {
         if (settings.ponder)
-            return false;
+        {
+            if (SearchFlags::ponder.test())
+                return false;
+            // ponderhit: the expected move was played and our clock is running now
+            settings.ponder = false;
+            searchStart = std::chrono::steady_clock::now();
+        }
 
         bool overtime = !settings.infiniteSearch && (elapsed() > moveTime || elapsed() > settings.maxTime);
 
@@ -230,6 +353,8 @@ namespace engine
     {
         killers = Tables::KillerTable();
         historyHeuristic = Tables::HistoryTable();
+        previousPV.clear();
+        previousRoot = 0;
     }
 
     void Engine::newSearch(board::Board _b, std::chrono::time_point<std::chrono::steady_clock> s)
@@ -242,6 +367,16 @@ namespace engine
         engineW = b.boards.back().isWhiteToPlay();
         currIDdepth = 0;
         nodes = 0;
+        cutoffs = 0;
+        firstMoveCutoffs = 0;
+        pawnTable.probes = 0;
+        pawnTable.hits = 0;
+        materialTable.probes = 0;
+        materialTable.hits = 0;
+        evalCache.probes = 0;
+        evalCache.hits = 0;
+        excludedMoves.fill(0);
+        staticEvals.fill(0);
 
         auto mytime = engineW ? settings.wmsec : settings.bmsec;
         [[maybe_unused]] auto myinc = engineW ? settings.winc : settings.binc;
@@ -261,64 +396,116 @@ namespace engine
     void Engine::rootSearch(board::Board _b, std::chrono::time_point<std::chrono::steady_clock> s)
     {
         newSearch(_b, s);
-        moves::genMoves(b, rootMoves);
-        
-        for (auto& i : rootMoves)
+        moves::Movelist<moves::ScoredMove> ml;
+        moves::genMoves(b, ml);
+        for (const auto& [move, score] : ml)
+        {
+            if (settings.searchMoves.empty()
+                || std::find(settings.searchMoves.cbegin(), settings.searchMoves.cend(), move) != settings.searchMoves.cend())
+            {
+                rootMoves.emplace_back().m = move;
+            }
+        }
+        staticEvals[0] = moves::isInCheck(b) ? negInf : cachedEvaluate();
+        const std::size_t multiPV = std::clamp<std::size_t>(settings.multiPV, 1, std::max<std::size_t>(rootMoves.size(), 1));
+        tt->nextGeneration();
+
+        // if both sides played the previous PV, its third move is the best guess here. The TT still
+        // holds its subtree, so the early iterations are cheap, but they are searched anyway so a
+        // search stopped early still returns a verified move.
+        if (previousPV.size() >= 3
+            && initialPos >= 3
+            && b.hashes[initialPos - 3] == previousRoot
+            && b.moves[initialMove - 2] == previousPV[0]
+            && b.moves[initialMove - 1] == previousPV[1])
         {
-            i.score = rootMinBound;
+            auto expected = std::find_if(rootMoves.begin(), rootMoves.end(), [this](const RootMove& rm) {
+                return rm.m == previousPV[2];
+                });
+            if (expected != rootMoves.end())
+            {
+                std::rotate(rootMoves.begin(), expected, std::next(expected));
+            }
         }
-        Eval worstCase = rootMinBound;
-        for (unsigned int k = 0; k <= 128; ++k)
+
+        for (unsigned int k = 0; k <= 128 && k <= settings.maxDepth && !rootMoves.empty(); ++k)
         {
             currIDdepth = k;
-            worstCase = rootMinBound;
+            // the multiPV best scores of this iteration in descending order,
+            // the remaining moves only need to prove they beat the last one
+            std::vector<Eval> bestScores;
+            Eval worstCase = rootMinBound;
             PrincipalVariation pv;
-            std::size_t i = 0;
-            
-            for (auto& [move, score] : rootMoves)
+
+            for (std::size_t i = 0; auto& rm : rootMoves)
             {
                 if (!settings.ignoreSearchFlags && !SearchFlags::searching.test())
                     goto endsearch;
-                b.makeMove(move);
+                const auto nodesBefore = nodes;
+                Eval score = rootMinBound;
+                b.makeMove(rm.m);
                 try 
                 {
-                    if (i == 0)
+                    if (i < multiPV)
                     {
-                        score = -alphaBetaSearch(pv, rootMinBound, -worstCase, k - 1, false);
+                        score = -alphaBetaSearch(pv, rootMinBound, rootMaxBound, k - 1, false);
                     }
                     else
                     {
-                        auto tmp = -alphaBetaSearch(pv, -worstCase - 1, -worstCase, k - 1, false);
-                        if (tmp > worstCase)
+                        score = -alphaBetaSearch(pv, -worstCase - 1, -worstCase, k - 1, false);
+                        if (score > worstCase)
                         {
-                            tmp = -alphaBetaSearch(pv, rootMinBound, -worstCase, k - 1, false);
+                            score = -alphaBetaSearch(pv, rootMinBound, -worstCase, k - 1, false);
                         }
-                        score = tmp;
                     }
                 }
                 catch (const Timeout&)
                 {
                     goto endsearch;
                 }
-                if (score > worstCase)
+                b.unmakeMove(rm.m);
+                rm.nodes = nodes - nodesBefore;
+
+                if (i < multiPV || score > worstCase)
                 {
-                    MainPV.clear();
-                    MainPV.splice_after(MainPV.before_begin(), pv);
-                    MainPV.push_front(move);
-                    worstCase = score;
+                    rm.score = score;
+                    rm.pv.clear();
+                    rm.pv.splice_after(rm.pv.before_begin(), pv);
+                    rm.pv.push_front(rm.m);
+                    bestScores.insert(std::upper_bound(bestScores.begin(), bestScores.end(), score, std::greater<>()), score);
+                    if (bestScores.size() > multiPV)
+                        bestScores.pop_back();
+                    if (bestScores.size() == multiPV)
+                        worstCase = bestScores.back();
+                }
+                else
+                {
+                    // failed low, the node count decides its place among the other moves that did
+                    rm.score = rootMinBound;
                 }
-                b.unmakeMove(move);
                 ++i;
             }
 
-            std::stable_sort(rootMoves.begin(), rootMoves.end(), [](const auto& a, const auto& b) {
-                return a > b;
+            std::stable_sort(rootMoves.begin(), rootMoves.end(), [](const RootMove& a, const RootMove& b) {
+                return a.score > b.score || (a.score == b.score && a.nodes > b.nodes);
                 });
+            MainPV = rootMoves[0].pv;
             eval = rootMoves[0].score;
             printPV(b);
         }
     endsearch:
-        SearchFlags::searching.clear();
+        // a bestmove must not be sent while pondering, even if the search is finished
+        while (settings.ponder && SearchFlags::ponder.test() && SearchFlags::searching.test())
+        {
+            std::this_thread::sleep_for(1ms);
+        }
+        if (!settings.ignoreSearchFlags)
+            SearchFlags::searching.clear();
+        if (!rootMoves.empty())
+        {
+            previousPV.assign(rootMoves[0].pv.begin(), rootMoves[0].pv.end());
+            previousRoot = b.hashes[initialPos - 1];
+        }
         /*
         engine_out << "info string capturePct " << tt->capturePct(b) << std::endl;
         engine_out << "info string usedPct " << tt->usedPct() << std::endl;
@@ -326,26 +513,40 @@ namespace engine
         engine_out << "info string CNode " << tt->nodeTypePct(Tables::CUT) << std::endl;
         engine_out << "info string ANode " << tt->nodeTypePct(Tables::ALL) << std::endl;
         */
-        eval = rootMoves[0].score;
+        eval = rootMoves.empty() ? eval : rootMoves[0].score;
         if (!settings.quiet)
         {
-            engine_out << "bestmove " << move2uciFormat(b.boards[initialPos - 1], rootMoves[0].m) << std::endl;
+            engine_out << "info string first move cutoffs " << 100.0 * firstMoveCutoffs / std::max<std::size_t>(cutoffs, 1) << "%" << std::endl;
+            engine_out << "info string pawn hash hits " << 100.0 * pawnTable.hits / std::max<std::size_t>(pawnTable.probes, 1) << "%" << std::endl;
+            engine_out << "info string material hash hits " << 100.0 * materialTable.hits / std::max<std::size_t>(materialTable.probes, 1) << "%" << std::endl;
+            engine_out << "info string eval cache hits " << 100.0 * evalCache.hits / std::max<std::size_t>(evalCache.probes, 1) << "%" << std::endl;
+            const board::QBB& root = b.boards[initialPos - 1];
+            engine_out << "bestmove " << move2uciFormat(root, rootMoves.empty() ? 0 : rootMoves[0].m);
+            // the second move of the PV is the reply we expect to ponder on
+            if (!rootMoves.empty() && std::next(rootMoves[0].pv.begin()) != rootMoves[0].pv.end())
+            {
+                board::QBB afterBest = root;
+                afterBest.makeMove(rootMoves[0].m);
+                engine_out << " ponder " << move2uciFormat(afterBest, *std::next(rootMoves[0].pv.begin()));
+            }
+            engine_out << std::endl;
         }
         engine_out.emit();
     }
 
-    Eval Engine::quiesceSearch(Eval alpha, Eval beta, int depth)
+    Eval Engine::quiesceSearch(Eval alpha, Eval beta, int depth, PrincipalVariation* pv)
     {
         if (insufficientMaterial(b) || threeFoldRep() || b.boards.back().get50() == 50)
             return 0;
-        if (shouldStop())
+        if (!settings.ignoreSearchFlags && shouldStop())
             SearchFlags::searching.clear();
         ++nodes;
 
-        if (Tables::tt[b.hashes.back()].key == b.hashes.back() && Tables::tt[b.hashes.back()].depth >= depth)
+        // a table cutoff would end the PV before its last position
+        if (!pv && (*tt)[b.hashes.back()].key == b.hashes.back() && (*tt)[b.hashes.back()].depth >= depth)
         {
-            auto nodetype = Tables::tt[b.hashes.back()].nodeType;
-            auto eval = Tables::tt[b.hashes.back()].eval;
+            auto nodetype = (*tt)[b.hashes.back()].nodeType;
+            auto eval = valueFromTT((*tt)[b.hashes.back()].eval, ply());
             if (nodetype == Tables::PV)
                 return eval;
             else if (nodetype == Tables::ALL && eval < alpha)
@@ -365,7 +566,7 @@ namespace engine
         {
             if (ml.size())
             {
-                standpat = evaluate(b);
+                standpat = cachedEvaluate(alpha, beta);
                 if (standpat >= beta)
                 {
                     return standpat;
@@ -380,7 +581,7 @@ namespace engine
                 moves::genMoves<!moves::QSearch, moves::Quiets>(b, ml);
                 if (ml.size())
                 {
-                    return evaluate(b);
+                    return cachedEvaluate();
                 }
                 else
                 {
@@ -395,7 +596,7 @@ namespace engine
                 moves::genMoves<!moves::QSearch, moves::Quiets>(b, ml);
                 if (!ml.size())
                 {
-                    return negInf;
+                    return -mateValue + static_cast<Eval>(ply());
                 }
             }
         }
@@ -410,12 +611,10 @@ namespace engine
             ++i;
         }
 
+        moves::partialInsertionSort(ml.begin(), ml.begin() + captureIterations, std::numeric_limits<std::int16_t>::min());
+
         for (std::size_t i = 0; i != ml.size(); ++i)
         {
-            if (i + 1 < captureIterations)
-            {
-                std::iter_swap(ml.begin() + i, std::max_element(ml.begin() + i, ml.end()));
-            }
             if (!check && i < captureIterations)
             {
                 if (ml[i].score < 0 || eval::getCaptureValue(b, ml[i].m) + 200 + standpat <= alpha)
@@ -427,8 +626,19 @@ namespace engine
                 throw Timeout();
             b.makeMove(ml[i].m);
             
-            currEval = std::max<Eval>(currEval, -quiesceSearch(-beta, -alpha, depth - 1));
+            PrincipalVariation pvChild;
+            const Eval childEval = -quiesceSearch(-beta, -alpha, depth - 1, pv ? &pvChild : nullptr);
             b.unmakeMove(ml[i].m);
+            if (childEval > currEval)
+            {
+                currEval = childEval;
+                if (pv)
+                {
+                    pv->clear();
+                    pv->splice_after(pv->before_begin(), pvChild);
+                    pv->push_front(ml[i].m);
+                }
+            }
             alpha = std::max(currEval, alpha);
             if (alpha >= beta)
             {
@@ -455,7 +665,7 @@ namespace engine
 
         auto nodeType = Tables::ALL;
 
-        if (shouldStop())
+        if (!settings.ignoreSearchFlags && shouldStop())
         {
             SearchFlags::searching.clear();
         }
@@ -465,11 +675,23 @@ namespace engine
         if (insufficientMaterial(b) || threeFoldRep() || b.boards.back().get50() == 50)
             return 0;
         ++nodes;
-        
-        if (Tables::tt[b.hashes.back()].key == b.hashes.back() && Tables::tt[b.hashes.back()].depth >= depth)
+
+        const auto currPly = ply();
+
+        // mate distance pruning: no score here can beat being mated now
+        // or mating on the next move
+        alpha = std::max<Eval>(alpha, -mateValue + static_cast<Eval>(currPly));
+        beta = std::min<Eval>(beta, mateValue - static_cast<Eval>(currPly) - 1);
+        if (alpha >= beta)
+            return alpha;
+
+        // set while searching every move except excludedMove for a singular extension
+        const Move excludedMove = currPly < maxPly ? excludedMoves[currPly] : 0;
+
+        if (!excludedMove && (*tt)[b.hashes.back()].key == b.hashes.back() && (*tt)[b.hashes.back()].depth >= depth)
         {
-            auto nodetype = Tables::tt[b.hashes.back()].nodeType;
-            auto eval = Tables::tt[b.hashes.back()].eval;
+            auto nodetype = (*tt)[b.hashes.back()].nodeType;
+            auto eval = valueFromTT((*tt)[b.hashes.back()].eval, currPly);
             if (nodetype == Tables::ALL && eval < alpha)
             {
                 return eval;
@@ -484,15 +706,129 @@ namespace engine
 
         const bool inCheck = moves::isInCheck(b);
 
-        if (!isPVNode(alpha, beta) && !nullBranch && !inCheck)
+        const Eval staticEval = inCheck ? negInf : cachedEvaluate();
+        if (currPly < maxPly)
+            staticEvals[currPly] = staticEval;
+        // compare with our previous move's position, unknown counts as improving
+        const bool improving = !inCheck && currPly >= 2 && currPly < maxPly && staticEval > staticEvals[currPly - 2];
+
+        // the search score stored in the TT is a better estimate than the
+        // static eval whenever its bound points past it
+        Eval nodeEval = staticEval;
+        if (!inCheck && (*tt)[b.hashes.back()].key == b.hashes.back())
         {
+            auto nodetype = (*tt)[b.hashes.back()].nodeType;
+            auto eval = valueFromTT((*tt)[b.hashes.back()].eval, currPly);
+            if (nodetype == Tables::PV
+                || (nodetype == Tables::CUT && eval > staticEval)
+                || (nodetype == Tables::ALL && eval < staticEval))
+            {
+                nodeEval = eval;
+            }
+        }
+
+        const bool PVNode = isPVNode(alpha, beta);
+
+        if (!PVNode && !inCheck && !excludedMove && !isMateScore(beta))
+        {
+            // reverse futility pruning
+            if (depth <= searchParams.rfpMaxDepth
+                && nodeEval - searchParams.rfpMargin * (depth - improving) >= beta)
+            {
+                return nodeEval;
+            }
+
+            // razoring
+            if (depth <= searchParams.razorMaxDepth
+                && nodeEval + searchParams.razorMargin * (depth + 1) < alpha)
+            {
+                Eval qeval = quiesceSearch(alpha, alpha + 1, 0);
+                if (qeval <= alpha)
+                {
+                    return qeval;
+                }
+            }
+        }
+
+        // no null move without pieces, zugzwang is too common in pawn endings
+        const bool hasNonPawnMaterial = b.boards.back().my(b.boards.back().getOccupancy() & ~b.boards.back().getPawns() & ~b.boards.back().getKings());
+
+        if (!PVNode && !nullBranch && !inCheck && !excludedMove && hasNonPawnMaterial && nodeEval >= beta)
+        {
+            const int R = searchParams.nmpBase + depth / searchParams.nmpDepthDivisor
+                + std::min((nodeEval - beta) / searchParams.nmpEvalDivisor, 3);
             b.makeMove(0);
-            Eval nulleval = -alphaBetaSearch(pvChild, -beta, -beta + 1, depth - 3, true);
+            Eval nulleval = -alphaBetaSearch(pvChild, -beta, -beta + 1, depth - 1 - R, true);
             b.unmakeMove(0);
             assert(b.boards.back() == currentBoard);
             if (nulleval >= beta)
             {
-                return nulleval;
+                // don't trust mate scores from a null move
+                if (nulleval >= mateBound)
+                    nulleval = beta;
+
+                if (depth < searchParams.nmpVerificationDepth)
+                    return nulleval;
+
+                // verify with a reduced search without null moves
+                Eval verification = alphaBetaSearch(pvChild, beta - 1, beta, depth - 1 - R, true);
+                if (verification >= beta)
+                    return nulleval;
+            }
+        }
+
+        // ProbCut: if a good capture beats beta by a margin at reduced depth,
+        // the full depth search would very likely fail high as well
+        const Eval probCutBeta = beta + searchParams.probCutMargin;
+        if (!PVNode
+            && !inCheck
+            && !excludedMove
+            && depth >= searchParams.probCutMinDepth
+            && !isMateScore(beta)
+            && !((*tt)[b.hashes.back()].key == b.hashes.back()
+                && (*tt)[b.hashes.back()].depth >= depth - searchParams.probCutReduction
+                && valueFromTT((*tt)[b.hashes.back()].eval, currPly) < probCutBeta))
+        {
+            moves::Movelist<moves::ScoredMove> captures;
+            moves::genMoves<moves::QSearch>(b, captures);
+            for (auto& [move, score] : captures)
+            {
+                score = eval::see(b, move);
+            }
+            const Eval minGain = probCutBeta - nodeEval;
+            moves::partialInsertionSort(captures.begin(), captures.end(), minGain);
+            for (const auto& [move, score] : captures)
+            {
+                if (score < minGain)
+                    break;
+                b.makeMove(move);
+                Eval probCutEval = -quiesceSearch(-probCutBeta, -probCutBeta + 1, 0);
+                if (probCutEval >= probCutBeta)
+                {
+                    probCutEval = -alphaBetaSearch(pvChild, -probCutBeta, -probCutBeta + 1, depth - searchParams.probCutReduction, nullBranch);
+                }
+                b.unmakeMove(move);
+                assert(b.boards.back() == currentBoard);
+                if (probCutEval >= probCutBeta)
+                {
+                    tt->tryStore(b.hashes.back(), depth - searchParams.probCutReduction + 1, valueToTT(probCutEval, currPly), move, Tables::CUT, tt->getGeneration(), true);
+                    return probCutEval;
+                }
+            }
+        }
+
+        // without a hash move, search PV nodes shallower first to find one
+        // (internal iterative deepening) and simply reduce the other nodes
+        const bool hasHashMove = (*tt)[b.hashes.back()].key == b.hashes.back() && (*tt)[b.hashes.back()].move;
+        if (!hasHashMove && !excludedMove)
+        {
+            if (PVNode && depth >= searchParams.iidMinDepth)
+            {
+                alphaBetaSearch(pvChild, alpha, beta, depth - 2, nullBranch);
+            }
+            else if (!PVNode && depth >= searchParams.iirMinDepth)
+            {
+                --depth;
             }
         }
 
@@ -505,17 +841,32 @@ namespace engine
 
         Move topMove = 0;
         Eval currEval = negInf;
-        moves::MoveOrder moves(&killers, &historyHeuristic, b.hashes.back(), ply());
+        moves::MoveOrder moves(tt, &killers, &historyHeuristic, b.hashes.back(), ply());
         Move nextMove = 0;
         std::size_t i = 0;
         Eval besteval = negInf;
-        const bool PVNode = isPVNode(alpha, beta);
 
         const bool doFPruning = (depth == 1 || depth == 2) && !moves::isInCheck(b);
+        const bool doQuietPruning = !PVNode && !inCheck;
         bool moveWasPruned = false;
         bool everythingPruned = true;
+        moves::Movelist<Move> quietsTried;
 
-        auto materialBalance = evaluate.materialBalance(b);
+        const auto materialBalance = doFPruning ? evaluate.materialBalance(b, materialTable) : Eval{ 0 };
+
+        // a TT move that failed high at nearly this depth is a singular extension candidate
+        const auto& ttEntry = (*tt)[b.hashes.back()];
+        const bool trySingular = !excludedMove
+            && depth >= searchParams.seMinDepth
+            && currPly < 2 * currIDdepth
+            && currPly < maxPly
+            && ttEntry.key == b.hashes.back()
+            && ttEntry.move
+            && ttEntry.nodeType == Tables::CUT
+            && ttEntry.depth >= depth - 3
+            && !isMateScore(ttEntry.eval);
+        const Move singularMove = trySingular ? ttEntry.move : 0;
+        const Eval singularBeta = trySingular ? ttEntry.eval - searchParams.seMargin * depth : 0;
 
         Eval margin = posInf;
         if (depth == 1)
@@ -530,14 +881,52 @@ namespace engine
             {
                 throw Timeout();
             }
-            
+
+            if (nextMove == excludedMove)
+            {
+                // not counted as a move, so the first move searched still has i == 0
+                --i;
+                continue;
+            }
+
+            int extension = 0;
+            if (nextMove == singularMove && moves.stageReturned == moves::Stage::hash)
+            {
+                // search all other moves at reduced depth against a lowered beta,
+                // if all of them fail low the TT move is singular and extended
+                PrincipalVariation pvSingular;
+                excludedMoves[currPly] = nextMove;
+                Eval singularEval;
+                try
+                {
+                    singularEval = alphaBetaSearch(pvSingular, singularBeta - 1, singularBeta, (depth - 1) / 2, nullBranch);
+                }
+                catch (const Timeout&)
+                {
+                    // otherwise the next search on this engine would exclude the move at this ply
+                    excludedMoves[currPly] = 0;
+                    throw;
+                }
+                excludedMoves[currPly] = 0;
+                if (singularEval < singularBeta)
+                {
+                    extension = 1;
+                }
+                else if (singularBeta >= beta)
+                {
+                    // multi-cut: the TT move and at least one other move beat beta
+                    return singularBeta;
+                }
+            }
+            const int newDepth = depth - 1 + extension;
+
             bool isMovingTo7thRank = moves::getBB(board::getMoveToSq(nextMove)) & board::rankMask(board::a7);
             if (doFPruning 
                 && !PVNode
                 && i != 0
                 && !moves::moveGivesCheck(b, nextMove)
-                && std::abs(alpha) < 10000
-                && std::abs(beta) < 10000
+                && !isMateScore(alpha)
+                && !isMateScore(beta)
                 && !board::isPromo(nextMove)
                 && !(b.boards.back().getPieceType(board::getMoveFromSq(nextMove)) == constants::myPawn && isMovingTo7thRank)
                 && materialBalance + eval::getCaptureValue(b, nextMove) + margin <= alpha)
@@ -547,25 +936,64 @@ namespace engine
                 continue;
             }
 
+            const bool isQuiet = !b.boards.back().isCapture(nextMove) && !board::isPromo(nextMove);
+
+            if (doQuietPruning
+                && isQuiet
+                && besteval > negInf
+                && depth <= searchParams.lmpMaxDepth
+                && !moves::moveGivesCheck(b, nextMove))
+            {
+                if (static_cast<int>(i) >= lateMoveCounts[improving][std::min<std::size_t>(depth, lateMoveCounts[0].size() - 1)])
+                {
+                    moves.skipQuiets();
+                    moveWasPruned = true;
+                    continue;
+                }
+                auto history = historyHeuristic.getHistoryScore(b.boards.back().getPieceCodeIdx(board::getMoveFromSq(nextMove)), board::getMoveToSq(nextMove));
+                if (moves.stageReturned == moves::Stage::quiets
+                    && depth <= searchParams.historyPruningMaxDepth
+                    && history < -searchParams.historyPruningMargin * depth)
+                {
+                    moveWasPruned = true;
+                    continue;
+                }
+            }
+
+            // prune moves that lose too much material in the exchange on their target square
+            if (!PVNode
+                && !inCheck
+                && besteval > negInf
+                && depth <= searchParams.seePruningMaxDepth)
+            {
+                if (isQuiet
+                    ? !moves::moveGivesCheck(b, nextMove) && !eval::seeGE(b, nextMove, -searchParams.seeQuietMargin * depth * depth)
+                    : !eval::seeGE(b, nextMove, -searchParams.seeCaptureMargin * depth))
+                {
+                    moveWasPruned = true;
+                    continue;
+                }
+            }
+
             everythingPruned = false;
             b.makeMove(nextMove);
 
             if (i == 0)
             {
-                currEval = -alphaBetaSearch(pvChild, -beta, -alpha, depth - 1, nullBranch);
+                currEval = -alphaBetaSearch(pvChild, -beta, -alpha, newDepth, nullBranch);
             }
             else
             {
                 bool isKiller = moves.stageReturned == moves::Stage::killer1Stage || moves.stageReturned == moves::Stage::killer2Stage;
-                auto LMRReduction = LMR(i, b.boards[b.boards.size() - 2], nextMove, b, depth, PVNode, isKiller);
-                currEval = -alphaBetaSearch(pvChild, -alpha - 1, -alpha, depth - 1 - LMRReduction, nullBranch);
+                auto LMRReduction = LMR(i, b.boards[b.boards.size() - 2], nextMove, b, depth, PVNode, isKiller, improving);
+                currEval = -alphaBetaSearch(pvChild, -alpha - 1, -alpha, newDepth - LMRReduction, nullBranch);
                 if (LMRReduction && currEval > alpha)
                 {
-                    currEval = -alphaBetaSearch(pvChild, -alpha - 1, -alpha, depth - 1, nullBranch);
+                    currEval = -alphaBetaSearch(pvChild, -alpha - 1, -alpha, newDepth, nullBranch);
                 }
                 if (currEval > alpha && currEval < beta)
                 {
-                    currEval = -alphaBetaSearch(pvChild, -beta, -alpha, depth - 1, nullBranch);
+                    currEval = -alphaBetaSearch(pvChild, -beta, -alpha, newDepth, nullBranch);
                 }
             }
             besteval = std::max(besteval, currEval);
@@ -573,16 +1001,28 @@ namespace engine
             assert(b.boards.back() == currentBoard);
             if (besteval >= beta)
             {
+                ++cutoffs;
+                firstMoveCutoffs += i == 0;
                 nodeType = Tables::CUT;
-                Tables::tt.tryStore(b.hashes.back(), depth, besteval, nextMove, nodeType, initialPos, moveWasPruned);
+                if (!excludedMove)
+                    tt->tryStore(b.hashes.back(), depth, valueToTT(besteval, currPly), nextMove, nodeType, tt->getGeneration(), moveWasPruned);
                 if (!b.boards.back().isCapture(nextMove))
                 {
                     killers.storeKiller(nextMove, ply());
                     auto piececodeidx = b.boards.back().getPieceCodeIdx(board::getMoveFromSq(nextMove));
-                    historyHeuristic.updateHistory(piececodeidx, board::getMoveToSq(nextMove), depth);
+                    historyHeuristic.updateHistory(piececodeidx, board::getMoveToSq(nextMove), historyBonus(depth));
+                    for (auto quiet : quietsTried)
+                    {
+                        piececodeidx = b.boards.back().getPieceCodeIdx(board::getMoveFromSq(quiet));
+                        historyHeuristic.updateHistory(piececodeidx, board::getMoveToSq(quiet), -historyBonus(depth));
+                    }
                 }
                 return besteval;
             }
+            if (isQuiet)
+            {
+                quietsTried.push_back(nextMove);
+            }
             if (currEval > alpha)
             {
                 nodeType = Tables::PV;
@@ -595,16 +1035,16 @@ namespace engine
         }
         if (i == 0)
         {
-            return moves::isInCheck(b) ? negInf : 0;
+            // the excluded move was the only legal move, which makes it singular
+            if (excludedMove)
+                return alpha;
+            return moves::isInCheck(b) ? -mateValue + static_cast<Eval>(currPly) : 0;
         }
 
-        if (nodeType == Tables::PV)
-        {
-            Tables::tt.tryStore(b.hashes.back(), depth, besteval, topMove, nodeType, initialPos, moveWasPruned);
-        }
-        else
+        // the result of a search without the best move must not replace its entry
+        if (!excludedMove)
         {
-            Tables::tt.tryStore(b.hashes.back(), depth, besteval, topMove, nodeType, initialPos, moveWasPruned);
+            tt->tryStore(b.hashes.back(), depth, valueToTT(besteval, currPly), topMove, nodeType, tt->getGeneration(), moveWasPruned);
         }
         return everythingPruned ? alpha : besteval;
     }
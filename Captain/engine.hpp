@@ -27,10 +27,14 @@ along with this program. If not, see <https://www.gnu.org/licenses/>.
 #include <forward_list>
 #include <fstream>
 #include <iostream>
+#include <array>
+#include <vector>
+#include <memory>
 
 #include "board.hpp"
 #include "moves.hpp"
 #include "eval.hpp"
+#include "nnue.hpp"
 #include "auxiliary.hpp"
 #include "searchflags.hpp"
 #include "tables.hpp"
@@ -51,6 +55,67 @@ namespace engine
     constexpr auto rootMinBound = -13000;
     constexpr auto rootMaxBound = 13000;
 
+    // Search parameters shared by all engines, exposed as UCI options
+    // so they can be tuned externally. Call initSearchTables after changing them.
+    struct SearchParams
+    {
+        // late move reduction = lmrBase + log(depth) * log(move number) / lmrDivisor
+        double lmrBase = 0.75;
+        double lmrDivisor = 2.25;
+        // every lmrHistoryDivisor points of history reduces one ply less
+        int lmrHistoryDivisor = 8192;
+        // late move pruning skips quiets after (lmpBase + depth^2) / (2 - improving) moves
+        int lmpBase = 3;
+        int lmpMaxDepth = 8;
+        // quiets with history below -historyPruningMargin * depth are pruned
+        int historyPruningMargin = 1024;
+        int historyPruningMaxDepth = 3;
+        // reverse futility pruning returns when eval - rfpMargin * depth >= beta
+        int rfpMargin = 75;
+        int rfpMaxDepth = 8;
+        // razoring drops into quiescence when eval + razorMargin * (depth + 1) < alpha
+        int razorMargin = 200;
+        int razorMaxDepth = 3;
+        // null move reduction = nmpBase + depth / nmpDepthDivisor + min((eval - beta) / nmpEvalDivisor, 3)
+        int nmpBase = 2;
+        int nmpDepthDivisor = 4;
+        int nmpEvalDivisor = 200;
+        // null move cutoffs at or above this depth are verified by a search without null moves
+        int nmpVerificationDepth = 10;
+        // singular extension search excludes the TT move and uses beta = TT score - seMargin * depth
+        int seMinDepth = 8;
+        int seMargin = 2;
+        // ProbCut searches captures with SEE >= beta + probCutMargin - eval
+        // against beta + probCutMargin at depth - probCutReduction
+        int probCutMinDepth = 5;
+        int probCutMargin = 200;
+        int probCutReduction = 4;
+        // nodes without a hash move: IID for PV nodes, otherwise reduce by one ply
+        int iidMinDepth = 6;
+        int iirMinDepth = 4;
+        // captures losing more than seeCaptureMargin * depth and quiets losing
+        // more than seeQuietMargin * depth^2 are pruned
+        int seePruningMaxDepth = 6;
+        int seeCaptureMargin = 100;
+        int seeQuietMargin = 25;
+    };
+
+    extern SearchParams searchParams;
+
+    void initSearchTables();
+
+    constexpr std::size_t maxPly = 256;
+
+    // being mated at ply p from the root scores -mateValue + p, so shorter
+    // mates are preferred. Anything beyond mateBound is a mate score.
+    constexpr Eval mateValue = 11000;
+    constexpr Eval mateBound = mateValue - static_cast<Eval>(maxPly);
+
+    constexpr bool isMateScore(Eval e)
+    {
+        return e >= mateBound || e <= -mateBound;
+    }
+
     struct SearchSettings
     {
         std::size_t maxDepth = std::numeric_limits<std::size_t>::max();
@@ -58,6 +123,8 @@ namespace engine
         std::size_t movestogo = std::numeric_limits<std::size_t>::max();
         bool infiniteSearch = false;
         bool ponder = false;
+        // neither read nor clear SearchFlags, so searches on other threads can't stop this one or be
+        // stopped by it. Only maxDepth ends the search then.
         bool ignoreSearchFlags = false;
         std::chrono::milliseconds maxTime = std::chrono::milliseconds::max();
         std::chrono::milliseconds wmsec = std::chrono::milliseconds::max();
@@ -65,6 +132,20 @@ namespace engine
         std::chrono::milliseconds winc = 0ms;
         std::chrono::milliseconds binc = 0ms;
         bool quiet = false;
+        // number of root moves searched with an exact score and reported
+        std::size_t multiPV = 1;
+        // restricts the root to these moves when not empty
+        std::vector<Move> searchMoves{};
+    };
+
+    struct RootMove
+    {
+        Move m = 0;
+        Eval score = rootMinBound;
+        // nodes spent on this move in the last iteration, breaks ties between
+        // moves that failed low
+        std::size_t nodes = 0;
+        PrincipalVariation pv{};
     };
 
     class Engine
@@ -74,24 +155,36 @@ namespace engine
         double getEval();
         Engine() :engine_out(std::cout) {}
         void setSettings(SearchSettings ss) noexcept { settings = ss; }
-        void setEvaluator(const eval::Evaluator& e) { evaluate = e; }
+        const eval::Evaluator& getEvaluator() const noexcept { return evaluate; }
+        // cached scores belong to the previous evaluator's weights
+        void setEvaluator(const eval::Evaluator& e) { evaluate = e; pawnTable.clear(); materialTable.clear(); evalCache.clear(); }
+        // evaluates with the network instead of the Evaluator while it's non-null
+        void setEvaluator(std::shared_ptr<const nnue::Network> n) { network = std::move(n); accumulators.clear(); evalCache.clear(); }
+        // searches with t instead of Tables::tt, t must outlive the engine's searches
+        void setTable(Tables::TTable& t) noexcept { tt = &t; }
         void newGame();
         void newSearch(board::Board, std::chrono::time_point<std::chrono::steady_clock>);
-        Eval quiesceSearch(Eval alpha, Eval beta, int depth);
+        // with pv, also fills it with the moves to the position whose evaluation is returned,
+        // without using the transposition table
+        Eval quiesceSearch(Eval alpha, Eval beta, int depth, PrincipalVariation* pv = nullptr);
         Eval eval = 0;
-        moves::Movelist<moves::ScoredMove> rootMoves;
+        std::vector<RootMove> rootMoves;
     private:
         std::string move2uciFormat(const board::QBB&, Move);
-        std::string getPVuciformat(board::QBB b);
+        std::string getPVuciformat(board::QBB b, const PrincipalVariation& pv);
         std::string getCurrline();
+        static std::string score2uciFormat(Eval);
         std::size_t ply() const;
         bool shouldStop() noexcept;
         void uciUpdate();
         bool threeFoldRep() const;
-        bool insufficientMaterial(const board::QBB&) const;
+        bool insufficientMaterial(const board::Board&) const;
+        // the evaluator's score for b, looked up in evalCache first; with a window the
+        // evaluator may return a lazy estimate, which is not cached
+        Eval cachedEvaluate(Eval alpha = negInf, Eval beta = posInf);
         Eval alphaBetaSearch(PrincipalVariation& pv, Eval, Eval, int, bool);
         bool isPVNode(Eval alpha, Eval beta);
-        int LMR(std::size_t i, const board::QBB& before, Move m, const board::QBB& after, int currDepth, bool PV, bool isKiller);
+        int LMR(std::size_t i, const board::QBB& before, Move m, const board::QBB& after, int currDepth, bool PV, bool isKiller, bool improving);
         void printPV(const board::QBB& b);
         std::string line2string(const std::vector<Move>& moves);
         std::chrono::milliseconds elapsed() const;
@@ -101,8 +194,13 @@ namespace engine
         std::chrono::time_point<std::chrono::steady_clock> searchStart;
         std::chrono::time_point<std::chrono::steady_clock> lastUpdate;
         std::size_t nodes = 0;
+        std::size_t cutoffs = 0;
+        std::size_t firstMoveCutoffs = 0;
         std::size_t currIDdepth = 0;
         PrincipalVariation MainPV;
+        // the previous search, reused when the game follows its PV
+        std::vector<Move> previousPV;
+        Hash previousRoot = 0;
         std::size_t initialMove = 0;
         std::size_t initialPos = 0;
         board::Board b;
@@ -111,7 +209,34 @@ namespace engine
         std::chrono::milliseconds moveTime = 0ms;
         Tables::KillerTable killers;
         Tables::HistoryTable historyHeuristic;
+        std::array<Eval, maxPly> staticEvals{};
+        std::array<Move, maxPly> excludedMoves{};
         eval::Evaluator evaluate;
+        Tables::PawnHashTable pawnTable;
+        Tables::MaterialTable materialTable;
+        Tables::EvalCache evalCache;
+        std::shared_ptr<const nnue::Network> network;
+        std::vector<nnue::Accumulator> accumulators;
+        Tables::TTable* tt = &Tables::tt;
+    };
+
+    // Engines for parallel jobs such as tuning. Every thread calling engine() gets an engine
+    // with a small transposition table of its own, kept for the thread's lifetime, so jobs
+    // neither construct engines per position nor share Tables::tt between threads.
+    class EnginePool
+    {
+        eval::Evaluator evaluator;
+        SearchSettings settings;
+        // tells the engines this pool set up from those of other pools
+        std::uint64_t id;
+    public:
+        static constexpr std::size_t tableSize = (1024 * 1024) / sizeof(Tables::Entry);
+
+        EnginePool(const eval::Evaluator&, SearchSettings);
+
+        // the calling thread's engine, set up with the pool's evaluator and settings
+        // and reset for a new game
+        Engine& engine();
     };
 }
 #endif
@@ -17,8 +17,12 @@ along with this program. If not, see <https://www.gnu.org/licenses/>.
 */
 
 #include <intrin.h>
+#include <immintrin.h>
 #include <algorithm>
 #include <chrono>
+#include <execution>
+#include <numeric>
+#include <cassert>
 
 #pragma intrinsic(_BitScanForward64)
 
@@ -33,21 +37,6 @@ namespace eval
 {
     using namespace aux;
 
-    Eval computeMaterialValue(Bitboard bb, const std::array<Eval, 64>& PSQT)
-    {
-        Eval mval = 0;
-
-        unsigned long index;
-
-        while (_BitScanForward64(&index, bb))
-        {
-            bb ^= setbit(index);
-
-            mval += PSQT[index];
-        }
-        return mval;
-    }
-
     std::uint32_t getLVA(const board::QBB& b, Bitboard attackers, Bitboard& least)
     {
         // TODO rank promoting pawns higher
@@ -144,61 +133,89 @@ namespace eval
         return scores[0];
     }
 
-    Eval Evaluator::applyAggressionBonus(std::size_t type, board::square enemyKingSq, Bitboard pieces) const
+    // Threshold version of SEE: only answers whether the exchange on the
+    // target square gains at least threshold, which lets it stop early
+    bool seeGE(const board::QBB& b, Move m, int threshold)
+    {
+        const auto movetype = board::getMoveInfo<constants::moveTypeMask>(m);
+        if (movetype == constants::KSCastle || movetype == constants::QSCastle || board::isPromo(m))
+            return threshold <= 0;
+
+        const board::square target = board::getMoveToSq(m);
+        const board::square from = board::getMoveFromSq(m);
+        constexpr std::array<int, 7> pieceval = {0, 100, 300, 300, 500, 900, 10000};
+
+        int swap = (movetype == constants::enPCap ? pieceval[constants::pawnCode] : pieceval[b.getPieceCode(target)]) - threshold;
+        if (swap < 0)
+            return false;
+
+        swap = pieceval[b.getPieceCode(from)] - swap;
+        if (swap <= 0)
+            return true;
+
+        Bitboard occ = b.getOccupancy() ^ aux::setbit(from) ^ aux::setbit(target);
+        if (movetype == constants::enPCap)
+            occ ^= aux::setbit(target - 8);
+        const Bitboard diag = b.getDiagSliders();
+        const Bitboard orth = b.getOrthSliders();
+        Bitboard attackers = moves::getAllAttackers(b, occ, target);
+        Bitboard side = ~b.side;
+        bool res = true;
+
+        while (true)
+        {
+            attackers &= occ;
+            const Bitboard sideAttackers = attackers & side;
+            if (!sideAttackers)
+                break;
+
+            res = !res;
+            Bitboard least = 0;
+            const auto attackertype = getLVA(b, sideAttackers, least);
+
+            // the king can only capture if the square is no longer defended
+            if (attackertype == constants::kingCode)
+                return (attackers & ~side) ? !res : res;
+
+            swap = pieceval[attackertype] - swap;
+            if (swap < static_cast<int>(res))
+                break;
+
+            occ ^= least;
+            attackers |= moves::getSliderAttackers(occ, target, diag & occ, orth & occ);
+            side = ~side;
+        }
+        return res;
+    }
+
+    template<typename S>
+    S Evaluator::applyAggressionBonus(std::size_t type, board::square enemyKingSq, Bitboard pieces) const
     {
         unsigned long index = 0;
-        Eval e = 0;
+        S e{};
         while (_BitScanForward64(&index, pieces))
         {
             pieces = _blsr_u64(pieces);
-            e += aggressionBonus(board::square(index), enemyKingSq, closenessBonus(type));
+            e += aggressionBonus(board::square(index), enemyKingSq, closenessBonus<S>(type));
         }
         return e;
     }
 
-    Eval Evaluator::apply7thRankBonus(Bitboard rooks, Bitboard rank) const
-    {
-        return rookRank7Bonus() * (_popcnt64(rooks & rank));
-    }
-
-    Eval Evaluator::materialBalance(const board::QBB& b) const
+    template<typename S>
+    S Evaluator::apply7thRankBonus(Bitboard rooks, Bitboard rank) const
     {
-        Eval balance = 0;
-        balance += piecevals(0) * (_popcnt64(b.my(b.getPawns())) - _popcnt64(b.their(b.getPawns())));
-        balance += piecevals(1) * (_popcnt64(b.my(b.getKnights())) - _popcnt64(b.their(b.getKnights())));
-        balance += piecevals(2) * (_popcnt64(b.my(b.getBishops())) - _popcnt64(b.their(b.getBishops())));
-        balance += piecevals(3) * (_popcnt64(b.my(b.getRooks())) - _popcnt64(b.their(b.getRooks())));
-        balance += piecevals(4) * (_popcnt64(b.my(b.getQueens())) - _popcnt64(b.their(b.getQueens())));
-        return balance;
+        return rookRank7Bonus<S>() * (_popcnt64(rooks & rank));
     }
 
-    unsigned Evaluator::totalMaterialValue(const board::QBB& b) const
+    Eval Evaluator::materialBalance(const board::Board& b, Tables::MaterialTable& materialTable) const
     {
-        unsigned materialVal = 0;
-        unsigned piecevalues[6] = { 100, 300, 300, 500, 900, 0 };
-        GetNextBit<board::square> currSquare(b.getOccupancy());
-        while (currSquare())
-        {
-            auto sq = currSquare.next;
-            auto pieceType = b.getPieceCodeIdx(sq);
-            materialVal += piecevalues[pieceType];
-        }
-        return materialVal;
-    }
-
-    bool Evaluator::isEndgame(const board::QBB& b) const
-    {
-        auto materialValue = 900 * (b.getQueens() & ~b.side);
-        materialValue += 500 * (b.getRooks() & ~b.side);
-        materialValue += 300 * (b.getBishops() & ~b.side);
-        materialValue += 300 * (b.getKnights() & ~b.side);
-        return materialValue < 1900;
+        return probeMaterial(b, materialTable).balance;
     }
 
-    Eval Evaluator::bishopOpenDiagonalBonus(Bitboard occ, Bitboard bishops) const
+    Score Evaluator::bishopOpenDiagonalBonus(Bitboard occ, Bitboard bishops) const
     {
         unsigned long index = 0;
-        Eval e = 0;
+        Score e;
         while (_BitScanForward64(&index, bishops))
         {
             bishops = _blsr_u64(bishops);
@@ -215,92 +232,428 @@ namespace eval
         return e;
     }
 
-    Eval Evaluator::rookOpenFileBonus(Bitboard pawns, Bitboard rooks) const
+    template<typename S>
+    S Evaluator::rookOpenFileBonus(Bitboard pawns, Bitboard rooks) const
     {
         unsigned long index = 0;
-        Eval e = 0;
+        S e{};
         while (_BitScanForward64(&index, rooks))
         {
             rooks = _blsr_u64(rooks);
             auto square = board::square(index);
-            e += ((board::fileMask(square) & pawns) == 0) * rookOpenFileBonus();
+            e += ((board::fileMask(square) & pawns) == 0) * rookOpenFileBonus<S>();
         }
         return e;
     }
 
-    Eval Evaluator::evalPawns(const Bitboard myPawns, const Bitboard theirPawns) const noexcept
+    namespace
     {
-        std::array<Bitboard, 8> files = {board::fileMask(board::a1), board::fileMask(board::b1), 
-        board::fileMask(board::c1), board::fileMask(board::d1), board::fileMask(board::e1),
-        board::fileMask(board::f1), board::fileMask(board::g1), board::fileMask(board::h1)};
+        enum PawnSet
+        {
+            MyPassed, TheirPassed,
+            // one bit per file
+            MyDoubled, TheirDoubled, MyTripled, TheirTripled, MyIsolated, TheirIsolated,
+            MyBackward, TheirBackward, MyConnected, TheirConnected,
+            // one bit per pawn island
+            MyIslands, TheirIslands,
+            PawnSetCount
+        };
+
+        static_assert(std::tuple_size_v<PawnSets> == PawnSetCount);
 
-        std::array<Bitboard, 8> neighboringFiles = {files[1], files[0] | files[2], 
-        files[1] | files[3], files[2] | files[4], files[3] | files[5], files[4] | files[6], 
-        files[5] | files[7], files[6]};
+#if defined(__AVX2__)
+        // One bitboard of each of four positions, with the operators pawnSets needs
+        struct Lanes
+        {
+            __m256i v;
+
+            Lanes(__m256i v) : v(v) {}
+            Lanes(Bitboard b) : v(_mm256_set1_epi64x(static_cast<long long>(b))) {}
+
+            friend Lanes operator&(Lanes a, Lanes b) { return _mm256_and_si256(a.v, b.v); }
+            friend Lanes operator|(Lanes a, Lanes b) { return _mm256_or_si256(a.v, b.v); }
+            friend Lanes operator^(Lanes a, Lanes b) { return _mm256_xor_si256(a.v, b.v); }
+            friend Lanes operator-(Lanes a, Lanes b) { return _mm256_sub_epi64(a.v, b.v); }
+            friend Lanes operator~(Lanes a) { return _mm256_xor_si256(a.v, _mm256_set1_epi64x(-1)); }
+            friend Lanes operator<<(Lanes a, int n) { return _mm256_sll_epi64(a.v, _mm_cvtsi32_si128(n)); }
+            friend Lanes operator>>(Lanes a, int n) { return _mm256_srl_epi64(a.v, _mm_cvtsi32_si128(n)); }
+        };
+#endif
 
-        Eval evaluation = 0;
-        for (auto file : files)
+        // moves::KSNorth and moves::KSSouth for Bitboard or Lanes
+        template<typename V>
+        V ksNorth(V occ, V g)
         {
-            evaluation -= doubledPawnPenalty() * (_popcnt64(myPawns & file) == 2);
-            evaluation -= tripledPawnPenalty() * (_popcnt64(myPawns & file) > 2);
-            evaluation += doubledPawnPenalty() * (_popcnt64(theirPawns & file) == 2);
-            evaluation += tripledPawnPenalty() * (_popcnt64(theirPawns & file) > 2);
+            V p = ~occ;
+            g = g | (p & (g << 8));
+            p = p & (p << 8);
+            g = g | (p & (g << 16));
+            p = p & (p << 16);
+            g = g | (p & (g << 32));
+            return g << 8;
         }
 
-        for (std::size_t i = 0; i != files.size(); ++i)
+        template<typename V>
+        V ksSouth(V occ, V g)
         {
-            if (myPawns & files[i])
-            {
-                if (!(myPawns & neighboringFiles[i]))
+            V p = ~occ;
+            g = g | (p & (g >> 8));
+            p = p & (p >> 8);
+            g = g | (p & (g >> 16));
+            p = p & (p >> 16);
+            g = g | (p & (g >> 32));
+            return g >> 8;
+        }
+
+        // The sets Evaluator::evalPawns scores, only shifts and masks so the pawns of several
+        // positions can be processed at once. Follows detectPassedPawns and moves::backwardPawns.
+        template<typename V>
+        std::array<V, PawnSetCount> pawnSets(const V myPawns, const V theirPawns)
+        {
+            const V notFileA = ~board::fileMask(board::a1);
+            const V notFileH = ~board::fileMask(board::h1);
+            const V none = Bitboard{ 0 };
+            auto attacks = [&](V pawns) { return ((pawns << 7) & notFileH) | ((pawns << 9) & notFileA); };
+            auto enemyAttacks = [&](V pawns) { return ((pawns >> 9) & notFileH) | ((pawns >> 7) & notFileA); };
+
+            std::array<V, PawnSetCount> sets{ none, none, none, none, none, none, none,
+                none, none, none, none, none, none, none };
+
+            V mySpans = attacks(myPawns) | (myPawns << 8);
+            mySpans = mySpans | ksNorth(none, mySpans);
+            V theirSpans = enemyAttacks(theirPawns) | (theirPawns >> 8);
+            theirSpans = theirSpans | ksSouth(none, theirSpans);
+            sets[MyPassed] = myPawns & ~theirSpans;
+            sets[TheirPassed] = theirPawns & ~mySpans;
+
+            // the number of pawns on each file in three bit planes
+            auto fileCounts = [&](V pawns) {
+                std::array<V, 3> planes{ none, none, none };
+                for (int rank = 0; rank != 8; ++rank)
                 {
-                    evaluation -= isolatedPawnPenalty();
+                    V carry = (pawns >> (8 * rank)) & Bitboard{ 0xFF };
+                    for (auto& plane : planes)
+                    {
+                        const V next = plane & carry;
+                        plane = plane ^ carry;
+                        carry = next;
+                    }
                 }
+                return planes;
+            };
+            const auto myCounts = fileCounts(myPawns);
+            const auto theirCounts = fileCounts(theirPawns);
+            sets[MyDoubled] = myCounts[1] & ~(myCounts[0] | myCounts[2]);
+            sets[TheirDoubled] = theirCounts[1] & ~(theirCounts[0] | theirCounts[2]);
+            sets[MyTripled] = (myCounts[1] & myCounts[0]) | myCounts[2];
+            sets[TheirTripled] = (theirCounts[1] & theirCounts[0]) | theirCounts[2];
+
+            const V myFiles = myCounts[0] | myCounts[1] | myCounts[2];
+            const V theirFiles = theirCounts[0] | theirCounts[1] | theirCounts[2];
+            sets[MyIsolated] = myFiles & ~((myFiles << 1) | (myFiles >> 1));
+            sets[TheirIsolated] = theirFiles & ~((theirFiles << 1) | (theirFiles >> 1));
+
+            const V myStops = myPawns << 8;
+            const V theirStops = theirPawns >> 8;
+            const V myAttackSpan = ksNorth(none, attacks(myPawns)) | attacks(myPawns);
+            const V theirAttackSpan = ksSouth(none, enemyAttacks(theirPawns)) | enemyAttacks(theirPawns);
+            V possMyBackwards = (myStops & enemyAttacks(theirPawns) & ~myAttackSpan) >> 8;
+            V possTheirBackwards = (theirStops & attacks(myPawns) & ~theirAttackSpan) << 8;
+            const V myBackwards = possMyBackwards & (board::rankMask(board::a2) | board::rankMask(board::a3));
+            const V theirBackwards = possTheirBackwards & (board::rankMask(board::a6) | board::rankMask(board::a7));
+            possMyBackwards = possMyBackwards - myBackwards;
+            possTheirBackwards = possTheirBackwards - theirBackwards;
+            possMyBackwards = possMyBackwards & ((myStops & enemyAttacks(theirPawns & ~theirBackwards)) >> 8);
+            possTheirBackwards = possTheirBackwards & ((theirStops & attacks(myPawns & ~myBackwards)) << 8);
+            sets[MyBackward] = myBackwards | possMyBackwards;
+            sets[TheirBackward] = theirBackwards | possTheirBackwards;
+
+            sets[MyConnected] = (((myPawns << 1) & notFileA) | ((myPawns >> 1) & notFileH)) & myPawns;
+            sets[TheirConnected] = (((theirPawns << 1) & notFileA) | ((theirPawns >> 1) & notFileH)) & theirPawns;
+
+            const V myFileset = ksSouth(myPawns, myPawns) & Bitboard{ 0xFF };
+            const V theirFileset = ksSouth(theirPawns, theirPawns) & Bitboard{ 0xFF };
+            sets[MyIslands] = myFileset & (myFileset ^ (myFileset >> 1));
+            sets[TheirIslands] = theirFileset & (theirFileset ^ (theirFileset >> 1));
+
+            return sets;
+        }
+
+#if defined(__AVX2__)
+        // The pawn sets of the four positions starting at i
+        std::array<PawnSets, 4> pawnSets(const PositionBatch& batch, std::size_t i)
+        {
+            auto load = [i](const std::vector<std::uint64_t>& field) {
+                return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(field.data() + i));
+            };
+            const Lanes side = load(batch.side);
+            const Lanes pbq = load(batch.pbq);
+            const Lanes pawns = pbq & ~(Lanes{ load(batch.nbk) } | load(batch.rqk));
+            const auto sets = pawnSets(pawns & side, pawns & ~side);
+
+            std::array<std::array<Bitboard, 4>, PawnSetCount> lanes;
+            for (std::size_t set = 0; set != PawnSetCount; ++set)
+            {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes[set].data()), sets[set].v);
             }
-            if (theirPawns & files[i])
+            std::array<PawnSets, 4> result;
+            for (std::size_t position = 0; position != result.size(); ++position)
             {
-                if (!(theirPawns & neighboringFiles[i]))
+                for (std::size_t set = 0; set != PawnSetCount; ++set)
                 {
-                    evaluation += isolatedPawnPenalty();
+                    result[position][set] = lanes[set][position];
                 }
             }
+            return result;
         }
+#endif
+    }
+
+    template<typename S>
+    S Evaluator::evalPawns(const Bitboard myPawns, const Bitboard theirPawns) const noexcept
+    {
+        return evalPawns<S>(pawnSets(myPawns, theirPawns));
+    }
+
+    template<typename S>
+    S Evaluator::evalPawns(const PawnSets& sets) const noexcept
+    {
+        S evaluation{};
+        evaluation -= doubledPawnPenalty<S>() * _popcnt64(sets[MyDoubled]);
+        evaluation -= tripledPawnPenalty<S>() * _popcnt64(sets[MyTripled]);
+        evaluation += doubledPawnPenalty<S>() * _popcnt64(sets[TheirDoubled]);
+        evaluation += tripledPawnPenalty<S>() * _popcnt64(sets[TheirTripled]);
 
-        auto [myPassedPawns, theirPassedPawns] = detectPassedPawns(myPawns, theirPawns);
+        evaluation -= isolatedPawnPenalty<S>() * _popcnt64(sets[MyIsolated]);
+        evaluation += isolatedPawnPenalty<S>() * _popcnt64(sets[TheirIsolated]);
 
-        aux::GetNextBit<board::square> ppSquare(myPassedPawns);
+        aux::GetNextBit<board::square> ppSquare(sets[MyPassed]);
         while (ppSquare())
         {
             auto rank = aux::rank(ppSquare.next);
-            evaluation += passedPawnBonus(rank);
+            evaluation += passedPawnBonus<S>(rank);
         }
 
-        ppSquare = aux::GetNextBit<board::square>{theirPassedPawns};
+        ppSquare = aux::GetNextBit<board::square>{sets[TheirPassed]};
         while (ppSquare())
         {
             auto rank = aux::rank(aux::flip(ppSquare.next));
-            evaluation -= passedPawnBonus(rank - 1);
+            evaluation -= passedPawnBonus<S>(rank - 1);
         }
 
-        auto [myBackwards, theirBackwards] = moves::backwardPawns(myPawns, theirPawns);
+        evaluation -= backwardsPawnPenalty<S>() * _popcnt64(sets[MyBackward]);
+        evaluation += backwardsPawnPenalty<S>() * _popcnt64(sets[TheirBackward]);
 
-        evaluation -= backwardsPawnPenalty() * _popcnt64(myBackwards);
-        evaluation += backwardsPawnPenalty() * _popcnt64(theirBackwards);
+        evaluation += connectedPawnBonus<S>() * _popcnt64(sets[MyConnected]);
+        evaluation -= connectedPawnBonus<S>() * _popcnt64(sets[TheirConnected]);
 
-        auto myConnectedPawns = (aux::shiftLeftNoWrap(myPawns) & myPawns) | (aux::shiftRightNoWrap(myPawns) & myPawns);
-        auto theirConnectedPawns = (aux::shiftLeftNoWrap(theirPawns) & theirPawns) | (aux::shiftRightNoWrap(theirPawns) & theirPawns);
+        evaluation += pawnIslandPenalty<S>() * _popcnt64(sets[MyIslands]);
+        evaluation -= pawnIslandPenalty<S>() * _popcnt64(sets[TheirIslands]);
 
-        evaluation += connectedPawnBonus() * _popcnt64(myConnectedPawns);
-        evaluation -= connectedPawnBonus() * _popcnt64(theirConnectedPawns);
+        return evaluation;
+    }
+
+    Tables::PawnEntry Evaluator::pawnEntry(Bitboard myPawns, Bitboard theirPawns) const noexcept
+    {
+        return pawnEntry(pawnSets(myPawns, theirPawns));
+    }
 
-        auto [myfileset, theirfileset] = moves::pawnFileset(myPawns, theirPawns);
+    Tables::PawnEntry Evaluator::pawnEntry(const PawnSets& sets) const noexcept
+    {
+        const Score pawnScore = evalPawns(sets);
+        return Tables::PawnEntry{ .myPassed = sets[MyPassed], .theirPassed = sets[TheirPassed],
+            .mg = static_cast<Eval>(pawnScore.mg), .eg = static_cast<Eval>(pawnScore.eg) };
+    }
 
-        evaluation += pawnIslandPenalty() * _popcnt64(myfileset & (myfileset ^ (myfileset >> 1)));
-        evaluation -= pawnIslandPenalty() * _popcnt64(theirfileset & (theirfileset ^ (theirfileset >> 1)));
+    template<typename S>
+    S Evaluator::materialScore(board::MaterialKey key) const
+    {
+        enum { P, N, B, R, Q };
+        std::array<int, 5> mine{}, theirs{};
+        for (unsigned i = 0; i != 5; ++i)
+        {
+            mine[i] = board::materialCount(key, i, true);
+            theirs[i] = board::materialCount(key, i, false);
+        }
 
-        return evaluation;
+        S material{};
+        for (std::size_t i = 0; i != 5; ++i)
+        {
+            material += piecevals<S>(i) * (mine[i] - theirs[i]);
+        }
+
+        const auto pawnCount = static_cast<std::size_t>(mine[P] + theirs[P]);
+        material += knightPawnCountPenalty<S>(pawnCount) * (mine[N] - theirs[N]);
+        material += rookPawnCountBonus<S>(pawnCount) * (mine[R] - theirs[R]);
+        // the key doesn't know the bishops' square colours, so any two bishops count as a pair
+        material += bishopPairBonus<S>(mine[B] >= 2);
+        material -= bishopPairBonus<S>(theirs[B] >= 2);
+        return material;
+    }
+
+    Tables::MaterialEntry Evaluator::materialEntry(board::MaterialKey key) const noexcept
+    {
+        enum { P, N, B, R, Q };
+        std::array<int, 5> mine{}, theirs{};
+        for (unsigned i = 0; i != 5; ++i)
+        {
+            mine[i] = board::materialCount(key, i, true);
+            theirs[i] = board::materialCount(key, i, false);
+        }
+
+        Score balance;
+        for (std::size_t i = 0; i != 5; ++i)
+        {
+            balance += piecevals(i) * (mine[i] - theirs[i]);
+        }
+        const Score material = materialScore(key);
+
+        const int phase = mine[N] + theirs[N] + mine[B] + theirs[B] + 2 * (mine[R] + theirs[R]) + 4 * (mine[Q] + theirs[Q]);
+
+        Tables::MaterialEntry entry{ .key = key, .mg = static_cast<Eval>(material.mg), .eg = static_cast<Eval>(material.eg),
+            .phase = static_cast<std::uint8_t>(std::min(phase, maxPhase)) };
+        entry.balance = taper(balance, entry.phase);
+
+        auto nonPawnMaterial = [this](const std::array<int, 5>& counts)
+        {
+            int npm = 0;
+            for (std::size_t i = N; i != 5; ++i)
+                npm += counts[i] * piecevals(i).eg;
+            return npm;
+        };
+
+        // without pawns, being up at most a bishop is rarely enough to win
+        auto scale = [&](const std::array<int, 5>& strong, const std::array<int, 5>& weak) -> std::uint8_t
+        {
+            const int strongNPM = nonPawnMaterial(strong);
+            const int weakNPM = nonPawnMaterial(weak);
+            if (strong[P] || strongNPM - weakNPM > piecevals(B).eg)
+                return 64;
+            if (strongNPM < piecevals(R).eg)
+                return 0;
+            return weakNPM <= piecevals(B).eg ? 4 : 14;
+        };
+        entry.myScale = scale(mine, theirs);
+        entry.theirScale = scale(theirs, mine);
+
+        constexpr std::array<int, 5> bare{}, bishopKnight{ 0, 1, 1, 0, 0 }, rook{ 0, 0, 0, 1, 0 }, pawn{ 1, 0, 0, 0, 0 };
+        if ((mine == bishopKnight && theirs == bare) || (theirs == bishopKnight && mine == bare))
+        {
+            entry.endgame = Tables::MaterialEntry::KBNK;
+            entry.strongSideIsMine = mine == bishopKnight;
+        }
+        else if ((mine == rook && theirs == pawn) || (theirs == rook && mine == pawn))
+        {
+            entry.endgame = Tables::MaterialEntry::KRKP;
+            entry.strongSideIsMine = mine == rook;
+        }
+
+        entry.oppositeBishopsCandidate = mine[B] == 1 && theirs[B] == 1
+            && !(mine[N] | theirs[N] | mine[R] | theirs[R] | mine[Q] | theirs[Q]);
+
+        // Bounds on one side's terms in evaluatePosition beyond material and pawn structure, from
+        // the largest count each term can be multiplied by, with king attacks bounded as if at most
+        // maxKingAttackers pieces hit the king area. The piece terms are scaled down by
+        // lazyMarginDivisor, which makes the margin an estimate rather than a bound.
+        constexpr int maxKingAttackers = 4;
+        auto magnitude = [](Score s) { return Score{ s.mg < 0 ? -s.mg : s.mg, s.eg < 0 ? -s.eg : s.eg }; };
+        auto larger = [](Score a, Score b) { return Score{ std::max(a.mg, b.mg), std::max(a.eg, b.eg) }; };
+        auto pieceTerms = [&](const std::array<int, 5>& own, const std::array<int, 5>& other)
+        {
+            Score m = 7 * magnitude(closenessBonus(5));
+            for (std::size_t i = 0; i != 5; ++i)
+                m += 7 * own[i] * magnitude(closenessBonus(i));
+            m += own[N] * (8 * magnitude(knightMobility()) + magnitude(undefendedKnightPenalty()) + magnitude(knightOutpostBonus()));
+            m += own[B] * (13 * magnitude(bishopMobility()) + magnitude(undefendedBishopPenalty()));
+            m += own[R] * (7 * magnitude(rookHorMobility()) + 7 * magnitude(rookVertMobility())
+                + magnitude(rookBehindPassedP()) + magnitude(rookOpenFileBonus()) + magnitude(rookRank7Bonus()));
+            if (own[R] >= 2)
+                m += magnitude(connectedRookBonus()) + magnitude(doubledRookBonus());
+
+            m += magnitude(kingFileOpenPenalty()) + 1.5 * magnitude(kingAdjFileOpenPenalty()) + magnitude(pawnShieldBonus());
+            const int attackers = std::min(other[P] + other[N] + other[B] + other[R] + other[Q], maxKingAttackers);
+            Score attackerValue;
+            for (std::size_t i = 0; i != 5; ++i)
+                attackerValue = larger(attackerValue, magnitude(kingAttackerValue(i)));
+            m += (attackers * attackers / 5.0) * attackerValue;
+            return m;
+        };
+        const Score kingTerms = larger(magnitude(kingCenterBonus()), magnitude(kingCenterRingBonus()))
+            + 8 * magnitude(kingPassedPDistPenalty());
+        const Score margin = 2 * kingTerms
+            + (pieceTerms(mine, theirs) + pieceTerms(theirs, mine)) * (1.0 / std::max(lazyMarginDivisor, 1));
+        entry.lazyMargin = taper(margin, entry.phase);
+
+        return entry;
+    }
+
+    Eval Evaluator::evaluateEndgame(const board::QBB& b, const Tables::MaterialEntry& material) const
+    {
+        const bool mine = material.strongSideIsMine;
+        const auto kings = b.getKings();
+        const auto strongKing = board::square(_tzcnt_u64(mine ? b.my(kings) : b.their(kings)));
+        const auto weakKing = board::square(_tzcnt_u64(mine ? b.their(kings) : b.my(kings)));
+        // ranks counted from the strong side's back rank
+        auto relativeRank = [mine](board::square s) { return mine ? static_cast<int>(rank(s)) : 7 - static_cast<int>(rank(s)); };
+
+        int value = 0;
+        switch (material.endgame)
+        {
+        case Tables::MaterialEntry::KBNK:
+        {
+            // mate is only possible in a corner the bishop controls, so drive the weak king there
+            const auto bishopSquares = (b.getBishops() & constants::whiteSquares) ? constants::whiteSquares : constants::blackSquares;
+            int cornerDistance = 7;
+            GetNextBit<board::square> corner(bishopSquares & (setbit(board::a1) | setbit(board::h1) | setbit(board::a8) | setbit(board::h8)));
+            while (corner())
+            {
+                cornerDistance = std::min(cornerDistance, squareDistance(weakKing, corner.next));
+            }
+            value = piecevals(1).eg + piecevals(2).eg + 200
+                + 40 * (7 - cornerDistance) + 10 * (7 - squareDistance(strongKing, weakKing));
+            break;
+        }
+        case Tables::MaterialEntry::KRKP:
+        {
+            const auto pawnSq = board::square(_tzcnt_u64(b.getPawns()));
+            const auto rookSq = board::square(_tzcnt_u64(b.getRooks()));
+            const auto queeningSq = board::square(mine ? file(pawnSq) : file(pawnSq) + 56);
+            const auto pushSq = board::square(mine ? pawnSq - 8 : pawnSq + 8);
+            const int rookValue = piecevals(3).eg;
+
+            if (file(strongKing) == file(pawnSq) && relativeRank(strongKing) < relativeRank(pawnSq))
+            {
+                // the strong king blocks the pawn
+                value = rookValue - squareDistance(strongKing, pawnSq);
+            }
+            else if (squareDistance(weakKing, pawnSq) >= 3 + !mine && squareDistance(weakKing, rookSq) >= 3)
+            {
+                // the weak king can neither support its pawn nor harass the rook
+                value = rookValue - squareDistance(strongKing, pawnSq);
+            }
+            else if (relativeRank(weakKing) <= 2 && squareDistance(weakKing, pawnSq) == 1
+                && relativeRank(strongKing) >= 3 && squareDistance(strongKing, pawnSq) > 2 + mine)
+            {
+                // the pawn is far advanced, supported, and the strong king is too far away
+                value = 80 - 8 * squareDistance(strongKing, pawnSq);
+            }
+            else
+            {
+                value = 200 - 8 * (squareDistance(strongKing, pushSq)
+                    - squareDistance(weakKing, pushSq)
+                    - squareDistance(pawnSq, queeningSq));
+            }
+            break;
+        }
+        default:
+            break;
+        }
+
+        return static_cast<Eval>(mine ? value : -value);
     }
 
-    Eval Evaluator::kingSafety(const board::QBB& b, board::square myKing, board::square theirKing) const
+    template<typename S>
+    S Evaluator::kingSafety(const board::QBB& b, board::square myKing, board::square theirKing) const
     {
         auto myKingFile = board::fileMask(myKing);
         auto theirKingFile = board::fileMask(theirKing);
@@ -309,48 +662,48 @@ namespace eval
         const auto myPawns = b.my(pawns);
         const auto theirPawns = b.their(pawns);
 
-        double myScalingFactor = (_popcnt64(b.their(b.getKnights())) * piecevals(1)
-            + _popcnt64(b.their(b.getBishops())) * piecevals(2)
-            + _popcnt64(b.their(b.getRooks())) * piecevals(3)
-            + _popcnt64(b.their(b.getQueens())) * piecevals(4));
-        myScalingFactor /= 2 * (piecevals(1) + piecevals(2) + piecevals(3)) + piecevals(4);
+        double myScalingFactor = (_popcnt64(b.their(b.getKnights())) * piecevals(1).mg
+            + _popcnt64(b.their(b.getBishops())) * piecevals(2).mg
+            + _popcnt64(b.their(b.getRooks())) * piecevals(3).mg
+            + _popcnt64(b.their(b.getQueens())) * piecevals(4).mg);
+        myScalingFactor /= 2 * (piecevals(1).mg + piecevals(2).mg + piecevals(3).mg) + piecevals(4).mg;
 
-        double theirScalingFactor = (_popcnt64(b.my(b.getKnights())) * piecevals(1)
-            + _popcnt64(b.my(b.getBishops())) * piecevals(2)
-            + _popcnt64(b.my(b.getRooks())) * piecevals(3)
-            + _popcnt64(b.my(b.getQueens())) * piecevals(4));
-        theirScalingFactor /= 2 * (piecevals(1) + piecevals(2) + piecevals(3)) + piecevals(4);
+        double theirScalingFactor = (_popcnt64(b.my(b.getKnights())) * piecevals(1).mg
+            + _popcnt64(b.my(b.getBishops())) * piecevals(2).mg
+            + _popcnt64(b.my(b.getRooks())) * piecevals(3).mg
+            + _popcnt64(b.my(b.getQueens())) * piecevals(4).mg);
+        theirScalingFactor /= 2 * (piecevals(1).mg + piecevals(2).mg + piecevals(3).mg) + piecevals(4).mg;
 
 
-        Eval evaluation = 0;
+        S evaluation{};
 
         if (!(myKingFile & pawns))
-            evaluation -= myScalingFactor * kingFileOpenPenalty();
+            evaluation -= myScalingFactor * kingFileOpenPenalty<S>();
         if (!(theirKingFile & pawns))
-            evaluation += theirScalingFactor * kingFileOpenPenalty();
+            evaluation += theirScalingFactor * kingFileOpenPenalty<S>();
 
 
         if (!(aux::shiftLeftNoWrap(myKingFile) & pawns))
-            evaluation -= myScalingFactor * kingAdjFileOpenPenalty();
+            evaluation -= myScalingFactor * kingAdjFileOpenPenalty<S>();
 
         if (!(aux::shiftRightNoWrap(myKingFile) & pawns))
-            evaluation -= 0.5 * myScalingFactor * kingAdjFileOpenPenalty();
+            evaluation -= 0.5 * myScalingFactor * kingAdjFileOpenPenalty<S>();
 
         if (!(aux::shiftLeftNoWrap(theirKingFile) & pawns))
-            evaluation += theirScalingFactor * kingAdjFileOpenPenalty();
+            evaluation += theirScalingFactor * kingAdjFileOpenPenalty<S>();
 
         if (!(aux::shiftRightNoWrap(theirKingFile) & pawns))
-            evaluation += 0.5 * theirScalingFactor * kingAdjFileOpenPenalty();
+            evaluation += 0.5 * theirScalingFactor * kingAdjFileOpenPenalty<S>();
 
         auto pawnShield = moves::pawnAttacks(myKing) | moves::pawnMovesUp(myKing);
 
         if (pawnShield == (pawnShield & myPawns))
-            evaluation += myScalingFactor * pawnShieldBonus();
+            evaluation += myScalingFactor * pawnShieldBonus<S>();
 
         pawnShield = moves::enemyPawnAttacks(theirKing) | (moves::getBB(theirKing) >> 8);
 
         if (pawnShield == (pawnShield & theirPawns))
-            evaluation -= theirScalingFactor * pawnShieldBonus();
+            evaluation -= theirScalingFactor * pawnShieldBonus<S>();
         
         auto kingArea = moves::kingAttacks(myKing) | moves::getBB(myKing);
 
@@ -361,11 +714,11 @@ namespace eval
         double attackerCountScale = (_popcnt64(pAttackers) + _popcnt64(kAttackers) + _popcnt64(bAttackers)
             + _popcnt64(rAttackers) + _popcnt64(qAttackers)) / 5.0;
 
-        evaluation -= attackerCountScale * myScalingFactor * _popcnt64(pAttackers) * kingAttackerValue(0);
-        evaluation -= attackerCountScale * myScalingFactor * _popcnt64(kAttackers) * kingAttackerValue(1);
-        evaluation -= attackerCountScale * myScalingFactor * _popcnt64(bAttackers) * kingAttackerValue(2);
-        evaluation -= attackerCountScale * myScalingFactor * _popcnt64(rAttackers) * kingAttackerValue(3);
-        evaluation -= attackerCountScale * myScalingFactor * _popcnt64(qAttackers) * kingAttackerValue(4);
+        evaluation -= attackerCountScale * myScalingFactor * _popcnt64(pAttackers) * kingAttackerValue<S>(0);
+        evaluation -= attackerCountScale * myScalingFactor * _popcnt64(kAttackers) * kingAttackerValue<S>(1);
+        evaluation -= attackerCountScale * myScalingFactor * _popcnt64(bAttackers) * kingAttackerValue<S>(2);
+        evaluation -= attackerCountScale * myScalingFactor * _popcnt64(rAttackers) * kingAttackerValue<S>(3);
+        evaluation -= attackerCountScale * myScalingFactor * _popcnt64(qAttackers) * kingAttackerValue<S>(4);
 
         kingArea = moves::kingAttacks(theirKing) | moves::getBB(theirKing);
 
@@ -375,18 +728,83 @@ namespace eval
         attackerCountScale = (_popcnt64(pAttackers) + _popcnt64(kAttackers) + _popcnt64(bAttackers)
             + _popcnt64(rAttackers) + _popcnt64(qAttackers)) / 5.0;
 
-        evaluation += attackerCountScale * theirScalingFactor * _popcnt64(pAttackers) * kingAttackerValue(0);
-        evaluation += attackerCountScale * theirScalingFactor * _popcnt64(kAttackers) * kingAttackerValue(1);
-        evaluation += attackerCountScale * theirScalingFactor * _popcnt64(bAttackers) * kingAttackerValue(2);
-        evaluation += attackerCountScale * theirScalingFactor * _popcnt64(rAttackers) * kingAttackerValue(3);
-        evaluation += attackerCountScale * theirScalingFactor * _popcnt64(qAttackers) * kingAttackerValue(4);
+        evaluation += attackerCountScale * theirScalingFactor * _popcnt64(pAttackers) * kingAttackerValue<S>(0);
+        evaluation += attackerCountScale * theirScalingFactor * _popcnt64(kAttackers) * kingAttackerValue<S>(1);
+        evaluation += attackerCountScale * theirScalingFactor * _popcnt64(bAttackers) * kingAttackerValue<S>(2);
+        evaluation += attackerCountScale * theirScalingFactor * _popcnt64(rAttackers) * kingAttackerValue<S>(3);
+        evaluation += attackerCountScale * theirScalingFactor * _popcnt64(qAttackers) * kingAttackerValue<S>(4);
         
         return evaluation;
     }
 
     Eval Evaluator::operator()(const board::QBB& b) const
     {
-        Eval evaluation = tempoBonus();
+        return evaluatePosition(b, pawnEntry(b.my(b.getPawns()), b.their(b.getPawns())), materialEntry(board::initialMaterialKey(b)));
+    }
+
+    const Tables::MaterialEntry& Evaluator::probeMaterial(const board::Board& b, Tables::MaterialTable& materialTable) const
+    {
+        const board::MaterialKey key = b.materialKeys.back();
+        auto& entry = materialTable[key];
+        ++materialTable.probes;
+        if (entry.key == key)
+        {
+            ++materialTable.hits;
+        }
+        else
+        {
+            entry = materialEntry(key);
+        }
+        return entry;
+    }
+
+    const Tables::PawnEntry& Evaluator::probePawns(const board::Board& b, Tables::PawnHashTable& pawnTable) const
+    {
+        const board::QBB& position = b;
+        const Hash key = b.pawnHashes.back();
+        auto& entry = pawnTable[key];
+        ++pawnTable.probes;
+        if (entry.key == key)
+        {
+            ++pawnTable.hits;
+        }
+        else
+        {
+            entry = pawnEntry(position.my(position.getPawns()), position.their(position.getPawns()));
+            entry.key = key;
+        }
+        return entry;
+    }
+
+    Eval Evaluator::operator()(const board::Board& b, Tables::PawnHashTable& pawnTable, Tables::MaterialTable& materialTable) const
+    {
+        return evaluatePosition(b, probePawns(b, pawnTable), probeMaterial(b, materialTable));
+    }
+
+    Eval Evaluator::operator()(const board::Board& b, Tables::PawnHashTable& pawnTable, Tables::MaterialTable& materialTable,
+        Eval alpha, Eval beta, bool& lazy) const
+    {
+        const auto& material = probeMaterial(b, materialTable);
+        const auto& pawns = probePawns(b, pawnTable);
+        lazy = false;
+        // scaled and special endgames can't be estimated from the unscaled terms
+        if (material.endgame == Tables::MaterialEntry::None && material.myScale == 64 && material.theirScale == 64
+            && !material.oppositeBishopsCandidate)
+        {
+            const Eval estimate = tempoBonus() + taper(Score{ material.mg + pawns.mg, material.eg + pawns.eg }, material.phase);
+            if (estimate - material.lazyMargin >= beta || estimate + material.lazyMargin <= alpha)
+            {
+                lazy = true;
+                return estimate;
+            }
+        }
+        return evaluatePosition(b, pawns, material);
+    }
+
+    template<typename S>
+    S Evaluator::positionalTerms(const board::QBB& b, Bitboard myPassed, Bitboard theirPassed) const
+    {
+        S evaluation{};
 
         const std::array<Bitboard, 12> pieces = {
             b.my(b.getPawns()),
@@ -406,43 +824,29 @@ namespace eval
         enum {myPawns, myKnights, myBishops, myRooks, myQueens, myKing,
             theirPawns, theirKnights, theirBishops, theirRooks, theirQueens, theirKing,};
 
-        for (std::size_t i = 0; i != 5; ++i)
-        {
-            evaluation += piecevals(i) * (_popcnt64(pieces[i]) - _popcnt64(pieces[i + 6]));
-        }
-
         const auto myKingSq = board::square(_tzcnt_u64(pieces[myKing]));
         const auto oppKingSq = board::square(_tzcnt_u64(pieces[theirKing]));
 
         for (std::size_t i = 0; i != 12; ++i)
         {
-            evaluation += (i < 6 ? 1 : -1) * applyAggressionBonus(i, i < 6 ? oppKingSq : myKingSq, pieces[i]);
+            evaluation += (i < 6 ? 1 : -1) * applyAggressionBonus<S>(i, i < 6 ? oppKingSq : myKingSq, pieces[i]);
         }
 
-        const auto pawnCount = _popcnt64(pieces[myPawns] | pieces[theirPawns]);
-
-        evaluation += _popcnt64(pieces[myKnights]) * knightPawnCountPenalty(pawnCount);
-        evaluation -= _popcnt64(pieces[theirKnights]) * knightPawnCountPenalty(pawnCount);
-        evaluation += _popcnt64(pieces[myRooks]) * rookPawnCountBonus(pawnCount);
-        evaluation -= _popcnt64(pieces[theirRooks]) * rookPawnCountBonus(pawnCount);
-
         auto myConnectRookCnt = _popcnt64(moves::KSRank(occ, pieces[myRooks]) & pieces[myRooks])/2;
         auto myDoubleRookCnt = _popcnt64(moves::KSFile(occ, pieces[myRooks]) & pieces[myRooks]) / 2;
         auto theirConnectRookCnt = _popcnt64(moves::KSRank(occ, pieces[theirRooks]) & pieces[theirRooks]) / 2;
         auto theirDoubleRookCnt = _popcnt64(moves::KSFile(occ, pieces[theirRooks]) & pieces[theirRooks]) / 2;
 
-        evaluation += myConnectRookCnt * connectedRookBonus();
-        evaluation -= theirConnectRookCnt * connectedRookBonus();
-        evaluation += myDoubleRookCnt * doubledRookBonus();
-        evaluation -= theirDoubleRookCnt * doubledRookBonus();
-
-        const auto [myPassed, theirPassed] = detectPassedPawns(pieces[myPawns], pieces[theirPawns]);
+        evaluation += myConnectRookCnt * connectedRookBonus<S>();
+        evaluation -= theirConnectRookCnt * connectedRookBonus<S>();
+        evaluation += myDoubleRookCnt * doubledRookBonus<S>();
+        evaluation -= theirDoubleRookCnt * doubledRookBonus<S>();
 
         const auto myRooksBehind = moves::KSSouth(myPassed, myPassed) & pieces[myRooks];
         const auto theirRooksBehind = moves::KSNorth(theirPassed, theirPassed) & pieces[theirRooks];
 
-        evaluation += rookBehindPassedP() * _popcnt64(myRooksBehind);
-        evaluation -= rookBehindPassedP() * _popcnt64(theirRooksBehind);
+        evaluation += rookBehindPassedP<S>() * _popcnt64(myRooksBehind);
+        evaluation -= rookBehindPassedP<S>() * _popcnt64(theirRooksBehind);
 
 
         aux::GetNextBit<Bitboard> mobility(pieces[myKnights]);
@@ -450,102 +854,228 @@ namespace eval
         {
             moves::AttackMap moves = moves::knightAttacks(mobility.next);
             moves &= ~(moves::enemyPawnAttacks(pieces[theirPawns]) | pieces[myKing] | pieces[myPawns]);
-            evaluation += knightMobility()*_popcnt64(moves);
+            evaluation += knightMobility<S>()*_popcnt64(moves);
             if (!moves::getMyAttackersBB(b, occ, mobility.next))
-                evaluation += undefendedKnightPenalty();
+                evaluation += undefendedKnightPenalty<S>();
         }
         mobility = GetNextBit<Bitboard>{ pieces[theirKnights] };
         while (mobility())
         {
             moves::AttackMap moves = moves::knightAttacks(mobility.next);
             moves &= ~(moves::pawnAttacks(pieces[myPawns]) | pieces[theirKing] | pieces[theirPawns]);
-            evaluation -= knightMobility()*_popcnt64(moves);
+            evaluation -= knightMobility<S>()*_popcnt64(moves);
             if (!moves::getTheirAttackersBB(b, occ, mobility.next))
-                evaluation -= undefendedKnightPenalty();
+                evaluation -= undefendedKnightPenalty<S>();
         }
         mobility = GetNextBit<Bitboard>{ pieces[myBishops] };
         while (mobility())
         {
             moves::AttackMap moves = moves::hypqAllDiag(occ & ~pieces[myQueens], mobility.next);
             moves &= ~(moves::enemyPawnAttacks(pieces[theirPawns]) | pieces[myKing] | pieces[myPawns]);
-            evaluation += bishopMobility()*_popcnt64(moves);
+            evaluation += bishopMobility<S>()*_popcnt64(moves);
             if (!moves::getMyAttackersBB(b, occ, mobility.next))
-                evaluation += undefendedBishopPenalty();
+                evaluation += undefendedBishopPenalty<S>();
         }
         mobility = GetNextBit<Bitboard>{ pieces[theirBishops] };
         while (mobility())
         {
             moves::AttackMap moves = moves::hypqAllDiag(occ & ~pieces[theirQueens], mobility.next);
             moves &= ~(moves::pawnAttacks(pieces[myPawns]) | pieces[theirKing] | pieces[theirPawns]);
-            evaluation -= bishopMobility()*_popcnt64(moves);
+            evaluation -= bishopMobility<S>()*_popcnt64(moves);
             if (!moves::getTheirAttackersBB(b, occ, mobility.next))
-                evaluation -= undefendedBishopPenalty();
+                evaluation -= undefendedBishopPenalty<S>();
         }
         mobility = GetNextBit<Bitboard>{ pieces[myRooks] };
         while (mobility())
         {
             moves::AttackMap moves = moves::hypqRank(occ & ~(pieces[myQueens] | pieces[myRooks]), mobility.next);
             moves &= ~(moves::enemyPawnAttacks(pieces[theirPawns]) | pieces[myKing] | pieces[myPawns]);
-            evaluation += rookHorMobility()*_popcnt64(moves);
+            evaluation += rookHorMobility<S>()*_popcnt64(moves);
             moves = moves::hypqFile(occ & ~(pieces[myQueens] | pieces[myRooks]), mobility.next);
             moves &= ~(moves::enemyPawnAttacks(pieces[theirPawns]) | pieces[myKing] | pieces[myPawns]);
-            evaluation += rookVertMobility()*_popcnt64(moves);
+            evaluation += rookVertMobility<S>()*_popcnt64(moves);
         }
         mobility = GetNextBit<Bitboard>{ pieces[theirRooks] };
         while (mobility())
         {
             moves::AttackMap moves = moves::hypqRank(occ & ~(pieces[theirQueens] | pieces[theirRooks]), mobility.next);
             moves &= ~(moves::pawnAttacks(pieces[myPawns]) | pieces[theirKing] | pieces[theirPawns]);
-            evaluation -= rookHorMobility()*_popcnt64(moves);
+            evaluation -= rookHorMobility<S>()*_popcnt64(moves);
             moves = moves::hypqFile(occ & ~(pieces[theirQueens] | pieces[theirRooks]), mobility.next);
             moves &= ~(moves::pawnAttacks(pieces[myPawns]) | pieces[theirKing] | pieces[theirPawns]);
-            evaluation -= rookVertMobility()*_popcnt64(moves);
+            evaluation -= rookVertMobility<S>()*_popcnt64(moves);
         }
 
-        evaluation += evalPawns(pieces[myPawns], pieces[theirPawns]); // TODO store this in pawn hash
+        // king activity matters in the endgame and king safety in the middlegame,
+        // their terms are weighted towards that phase
+        evaluation += kingCentralization<S>(myKingSq);
+        evaluation -= kingCentralization<S>(oppKingSq);
 
-        if (isEndgame(b))
+        auto expansion = moves::kingAttacks(myPassed) | myPassed;
+        unsigned distance;
+
+        if (expansion)
         {
-            evaluation += kingCentralization(myKingSq);
-            evaluation -= kingCentralization(oppKingSq);
+            for (distance = 1; !(expansion & pieces[myKing]); ++distance)
+                expansion |= moves::kingAttacks(expansion);
+            evaluation -= kingPassedPDistPenalty<S>() * distance;
+        }
 
-            auto expansion = moves::kingAttacks(myPassed) | myPassed;
-            unsigned distance;
+        expansion = moves::kingAttacks(theirPassed) | theirPassed;
 
-            if (expansion)
-            {
-                for (distance = 1; !(expansion & pieces[myKing]); ++distance)
-                    expansion |= moves::kingAttacks(expansion);
-                evaluation -= kingPassedPDistPenalty() * distance;
-            }
+        if (expansion)
+        {
+            for (distance = 1; !(expansion & pieces[theirKing]); ++distance)
+                expansion |= moves::kingAttacks(expansion);
+            evaluation += kingPassedPDistPenalty<S>() * distance;
+        }
 
-            expansion = moves::kingAttacks(theirPassed) | theirPassed;
+        evaluation += kingSafety<S>(b, myKingSq, oppKingSq);
 
-            if (expansion)
-            {
-                for (distance = 1; !(expansion & pieces[theirKing]); ++distance)
-                    expansion |= moves::kingAttacks(expansion);
-                evaluation += kingPassedPDistPenalty() * distance;
-            }
+        evaluation += applyKnightOutPostBonus<OutpostType::MyOutpost, S>(pieces[1], pieces[0], pieces[6]);
+        evaluation -= applyKnightOutPostBonus<OutpostType::OppOutpost, S>(pieces[7], pieces[0], pieces[6]);
+
+        evaluation += rookOpenFileBonus<S>(pieces[myPawns] | pieces[theirPawns], pieces[myRooks]);
+        evaluation -= rookOpenFileBonus<S>(pieces[myPawns] | pieces[theirPawns], pieces[theirRooks]);
+
+        evaluation += apply7thRankBonus<S>(pieces[myRooks], board::rankMask(board::a7));
+        evaluation -= apply7thRankBonus<S>(pieces[theirRooks], board::rankMask(board::a2));
+
+        return evaluation;
+    }
+
+    int Evaluator::egScale(const board::QBB& b, const Tables::MaterialEntry& material, int eg) const
+    {
+        int scale = eg > 0 ? material.myScale : material.theirScale;
+        if (material.oppositeBishopsCandidate)
+        {
+            const auto bishops = b.getBishops();
+            if ((bishops & constants::whiteSquares) && (bishops & constants::blackSquares))
+                scale = std::min(scale, 32);
         }
-        else
+        return scale;
+    }
+
+    Eval Evaluator::evaluatePosition(const board::QBB& b, const Tables::PawnEntry& pawns, const Tables::MaterialEntry& material) const
+    {
+        if (material.endgame != Tables::MaterialEntry::None)
+            return evaluateEndgame(b, material);
+
+        Score evaluation{ material.mg + pawns.mg, material.eg + pawns.eg };
+        evaluation += positionalTerms(b, pawns.myPassed, pawns.theirPassed);
+        evaluation.eg = evaluation.eg * egScale(b, material, evaluation.eg) / 64;
+
+        return tempoBonus() + taper(evaluation, material.phase);
+    }
+
+    EvalTrace Evaluator::trace(const board::QBB& b) const
+    {
+        const auto material = materialEntry(board::initialMaterialKey(b));
+        EvalTrace t{ .phase = material.phase, .eval = (*this)(b) };
+        if (material.endgame != Tables::MaterialEntry::None)
         {
-            evaluation += kingSafety(b, myKingSq, oppKingSq);
+            t.linear = false;
+            return t;
         }
 
-        evaluation += this->bishopPairBonus((pieces[2] & constants::whiteSquares) && (pieces[2] & constants::blackSquares));
-        evaluation -= this->bishopPairBonus((pieces[8] & constants::whiteSquares) && (pieces[8] & constants::blackSquares));
+        const Bitboard myPawns = b.my(b.getPawns());
+        const Bitboard theirPawns = b.their(b.getPawns());
+        const auto [myPassed, theirPassed] = detectPassedPawns(myPawns, theirPawns);
+        const TracedScore evaluation = materialScore<TracedScore>(board::initialMaterialKey(b))
+            + evalPawns<TracedScore>(myPawns, theirPawns)
+            + positionalTerms<TracedScore>(b, myPassed, theirPassed);
 
-        evaluation += this->applyKnightOutPostBonus<OutpostType::MyOutpost>(pieces[1], pieces[0], pieces[6]);
-        evaluation -= this->applyKnightOutPostBonus<OutpostType::OppOutpost>(pieces[7], pieces[0], pieces[6]);
+        t.coefficients = evaluation.coefficients;
+        t.egScale = egScale(b, material, evaluation.value.eg) / 64.0;
+        return t;
+    }
 
-        evaluation += this->rookOpenFileBonus(pieces[myPawns] | pieces[theirPawns], pieces[myRooks]);
-        evaluation -= this->rookOpenFileBonus(pieces[myPawns] | pieces[theirPawns], pieces[theirRooks]);
+    std::vector<board::MaterialKey> materialKeys(const PositionBatch& batch)
+    {
+        std::vector<board::MaterialKey> keys(batch.size());
+        std::size_t i = 0;
+#if defined(__AVX2__)
+        // popcount of each 64 bit lane: look up the count of every nibble, then sum the bytes of each lane
+        const auto nibbleCounts = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        const auto lowNibbles = _mm256_set1_epi8(0x0F);
+        auto popcount = [&](__m256i v) {
+            const auto lo = _mm256_shuffle_epi8(nibbleCounts, _mm256_and_si256(v, lowNibbles));
+            const auto hi = _mm256_shuffle_epi8(nibbleCounts, _mm256_and_si256(_mm256_srli_epi16(v, 4), lowNibbles));
+            return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+        };
+        auto load = [](const std::vector<std::uint64_t>& field, std::size_t j) {
+            return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(field.data() + j));
+        };
 
-        evaluation += this->apply7thRankBonus(pieces[myRooks], board::rankMask(board::a7));
-        evaluation -= this->apply7thRankBonus(pieces[theirRooks], board::rankMask(board::a2));
+        for (; i + 4 <= batch.size(); i += 4)
+        {
+            const Lanes side = load(batch.side, i);
+            const Lanes pbq = load(batch.pbq, i);
+            const Lanes nbk = load(batch.nbk, i);
+            const Lanes rqk = load(batch.rqk, i);
+            // in board::pieceType order
+            const std::array<Lanes, 5> pieces = {
+                pbq & ~(nbk | rqk),
+                nbk & ~(pbq | rqk),
+                pbq & nbk,
+                rqk & ~(pbq | nbk),
+                pbq & rqk,
+            };
+            auto key = _mm256_setzero_si256();
+            for (unsigned piece = 0; piece != pieces.size(); ++piece)
+            {
+                const auto mine = popcount((pieces[piece] & side).v);
+                const auto theirs = popcount((pieces[piece] & ~side).v);
+                key = _mm256_add_epi64(key, _mm256_sll_epi64(mine, _mm_cvtsi32_si128(board::materialShift(piece, true))));
+                key = _mm256_add_epi64(key, _mm256_sll_epi64(theirs, _mm_cvtsi32_si128(board::materialShift(piece, false))));
+            }
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(keys.data() + i), key);
+        }
+#endif
+        for (; i != batch.size(); ++i)
+        {
+            keys[i] = board::initialMaterialKey(batch[i]);
+        }
+        return keys;
+    }
 
-        return evaluation;
+    void Evaluator::operator()(const PositionBatch& batch, std::span<Eval> out) const
+    {
+        assert(out.size() == batch.size());
+        const auto keys = materialKeys(batch);
+
+        constexpr std::size_t chunkSize = 16384;
+        std::vector<std::size_t> chunks((batch.size() + chunkSize - 1) / chunkSize);
+        std::iota(chunks.begin(), chunks.end(), std::size_t{ 0 });
+
+        std::for_each(std::execution::par, chunks.begin(), chunks.end(), [&](std::size_t chunk) {
+            Tables::MaterialTable materialTable;
+            auto evaluate = [&](std::size_t i, const PawnSets& pawns) {
+                auto& material = materialTable[keys[i]];
+                if (material.key != keys[i])
+                    material = materialEntry(keys[i]);
+                out[i] = evaluatePosition(batch[i], pawnEntry(pawns), material);
+            };
+
+            const std::size_t end = std::min(batch.size(), (chunk + 1) * chunkSize);
+            std::size_t i = chunk * chunkSize;
+#if defined(__AVX2__)
+            for (; i + 4 <= end; i += 4)
+            {
+                const auto pawns = pawnSets(batch, i);
+                for (std::size_t lane = 0; lane != pawns.size(); ++lane)
+                {
+                    evaluate(i + lane, pawns[lane]);
+                }
+            }
+#endif
+            for (; i != end; ++i)
+            {
+                const auto b = batch[i];
+                evaluate(i, pawnSets(b.my(b.getPawns()), b.their(b.getPawns())));
+            }
+        });
     }
 
     std::string Evaluator::asString() const
@@ -591,11 +1121,13 @@ namespace eval
         for (std::size_t i = 5; i != 9; ++i)
         {
             e.evalTerms[i] = mutate(ZeroTo8, e.evalTerms[i]);
+            e.evalTerms[Evaluator::termCount + i] = mutate(ZeroTo8, e.evalTerms[Evaluator::termCount + i]);
         }
 
         for (std::size_t i = 18; i != 42; i += 2)
         {
             e.evalTerms[i] = mutate(ZeroTo8, e.evalTerms[i]);
+            e.evalTerms[Evaluator::termCount + i] = mutate(ZeroTo8, e.evalTerms[Evaluator::termCount + i]);
         }
 
     }
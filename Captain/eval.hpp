@@ -24,19 +24,77 @@ along with this program. If not, see <https://www.gnu.org/licenses/>.
 #include <array>
 #include <random>
 #include <span>
+#include <algorithm>
+#include <type_traits>
+#include <vector>
 
 #include "auxiliary.hpp"
 #include "board.hpp"
 #include "moves.hpp"
+#include "tables.hpp"
 
 namespace eval
 {
     using namespace aux;
     using Eval = std::int16_t;
 
+    // a term's middlegame and endgame values, blended by the game phase at the end of evaluation
+    struct Score
+    {
+        int mg = 0;
+        int eg = 0;
+
+        constexpr Score& operator+=(Score s) noexcept
+        {
+            mg += s.mg;
+            eg += s.eg;
+            return *this;
+        }
+
+        constexpr Score& operator-=(Score s) noexcept
+        {
+            mg -= s.mg;
+            eg -= s.eg;
+            return *this;
+        }
+    };
+
+    constexpr Score operator+(Score a, Score b) noexcept { return a += b; }
+    constexpr Score operator-(Score a, Score b) noexcept { return a -= b; }
+    constexpr Score operator-(Score a) noexcept { return Score{ -a.mg, -a.eg }; }
+
+    template<typename T> requires std::is_arithmetic_v<T>
+    constexpr Score operator*(Score s, T t) noexcept
+    {
+        return Score{ static_cast<int>(s.mg * t), static_cast<int>(s.eg * t) };
+    }
+
+    template<typename T> requires std::is_arithmetic_v<T>
+    constexpr Score operator*(T t, Score s) noexcept
+    {
+        return s * t;
+    }
+
+    // 24 with all minor and major pieces on the board, 0 with none of them
+    constexpr int maxPhase = 24;
+
+    constexpr Eval taper(Score s, int phase)
+    {
+        return static_cast<Eval>((s.mg * phase + s.eg * (maxPhase - phase)) / maxPhase);
+    }
+
+    // number of king moves between two squares
+    constexpr int squareDistance(board::square a, board::square b)
+    {
+        const int rankDistance = static_cast<int>(rank(a)) - static_cast<int>(rank(b));
+        const int fileDistance = static_cast<int>(file(a)) - static_cast<int>(file(b));
+        return std::max(rankDistance < 0 ? -rankDistance : rankDistance, fileDistance < 0 ? -fileDistance : fileDistance);
+    }
+
     std::uint32_t getLVA(const board::QBB&, Bitboard, Bitboard&);
     Eval getCaptureValue(const board::QBB&, Move);
     Eval see(const board::QBB&, Move);
+    bool seeGE(const board::QBB&, Move, int threshold);
 
     // TODO better squareControl function
     constexpr Eval squareControl(const board::QBB& b, board::square s)
@@ -72,76 +130,137 @@ namespace eval
         return control;
     }
 
-    Eval computeMaterialValue(Bitboard, const std::array<Eval, 64>&);
 
+    // Many positions stored field by field, so one field of consecutive positions can be
+    // loaded into a vector register at once
+    struct PositionBatch
+    {
+        std::vector<std::uint64_t> side;
+        std::vector<std::uint64_t> pbq;
+        std::vector<std::uint64_t> nbk;
+        std::vector<std::uint64_t> rqk;
+        std::vector<std::uint64_t> epc;
+
+        void push_back(const board::QBB& b)
+        {
+            side.push_back(b.side);
+            pbq.push_back(b.pbq);
+            nbk.push_back(b.nbk);
+            rqk.push_back(b.rqk);
+            epc.push_back(b.epc);
+        }
+
+        board::QBB operator[](std::size_t i) const
+        {
+            board::QBB b;
+            b.side = side[i];
+            b.pbq = pbq[i];
+            b.nbk = nbk[i];
+            b.rqk = rqk[i];
+            b.epc = epc[i];
+            return b;
+        }
+
+        std::size_t size() const noexcept { return side.size(); }
+    };
+
+    // material keys of every position in the batch, four positions per AVX2 register
+    std::vector<board::MaterialKey> materialKeys(const PositionBatch&);
+
+    // The pawn structure of a position as sets of squares and files, see pawnSets in eval.cpp
+    using PawnSets = std::array<Bitboard, 14>;
+
+    struct EvalTrace;
 
     // This class represents a single evaluation function (useful for tuning)
     class Evaluator
     {
     public:
         using PSQT = std::array<Eval, 64>;
-        constexpr Eval piecevals(std::size_t i) const { return evalTerms[i]; };
-        constexpr Eval knightMobility() const { return evalTerms[5]; }
-        constexpr Eval bishopMobility() const { return evalTerms[6]; }
-        constexpr Eval rookVertMobility() const { return evalTerms[7]; }
-        constexpr Eval rookHorMobility() const { return evalTerms[8]; }
-        constexpr Eval doubledPawnPenalty() const { return evalTerms[9]; }
-        constexpr Eval tripledPawnPenalty() const { return evalTerms[10]; }
-        constexpr Eval isolatedPawnPenalty() const { return evalTerms[11]; }
-        constexpr Eval passedPawnBonus(std::size_t rank) const { return evalTerms[12 + rank - 1]; }
-        constexpr Eval closenessBonus(std::size_t pt) const { return evalTerms[18 + (pt % 6)]; }
-        constexpr Eval knightPawnCountPenalty(std::size_t pawnCount) const { return evalTerms[24 + (pawnCount / 4)]; }
-        constexpr Eval rookPawnCountBonus(std::size_t pawnCount) const { return evalTerms[29 + (pawnCount / 4)]; }
-        constexpr Eval connectedRookBonus() const {return evalTerms[34];}
-        constexpr Eval doubledRookBonus() const { return evalTerms[35]; }
-        constexpr Eval undefendedKnightPenalty() const { return evalTerms[36]; }
-        constexpr Eval undefendedBishopPenalty() const { return evalTerms[37]; }
-        constexpr Eval kingPassedPDistPenalty() const { return evalTerms[38]; }
-        constexpr Eval rookBehindPassedP() const { return evalTerms[39]; }
-        constexpr Eval pawnIslandPenalty() const { return evalTerms[40]; }
-        constexpr Eval connectedPawnBonus() const { return evalTerms[41]; }
-        constexpr Eval bishopOpenDiagBonus() const { return evalTerms[42]; }
-        constexpr Eval rookOpenFileBonus() const { return evalTerms[43]; }
-        constexpr Eval rookRank7Bonus() const { return evalTerms[44]; }
-        constexpr Eval bishopPairBonus() const { return evalTerms[45]; }
-        constexpr Eval kingCenterBonus() const { return evalTerms[46]; }
-        constexpr Eval kingCenterRingBonus() const { return evalTerms[47]; }
-        constexpr Eval knightOutpostBonus() const { return evalTerms[48]; }
-        constexpr Eval kingAdjFileOpenPenalty() const { return evalTerms[49]; }
-        constexpr Eval kingFileOpenPenalty() const { return evalTerms[50]; }
-        constexpr Eval pawnShieldBonus() const { return evalTerms[51]; }
-        constexpr Eval kingAttackerValue(std::size_t type) const { return evalTerms[52 + type]; }
-        constexpr Eval backwardsPawnPenalty() const { return evalTerms[57]; }
-        constexpr Eval tempoBonus() const { return 10; } // Tempo not subject to tuning
-
-        std::array<Eval, 58> evalTerms =
+        static constexpr std::size_t termCount = 58;
+        // evalTerms holds the middlegame values of all terms followed by their endgame values
+        // S is Score, or TracedScore to also record which term the value came from
+        template<typename S = Score>
+        constexpr S term(std::size_t i) const
+        {
+            const Score value{ evalTerms[i], evalTerms[termCount + i] };
+            if constexpr (std::is_same_v<S, Score>)
+                return value;
+            else
+                return S::unit(i, value);
+        }
+        template<typename S = Score> constexpr S piecevals(std::size_t i) const { return term<S>(i); }
+        template<typename S = Score> constexpr S knightMobility() const { return term<S>(5); }
+        template<typename S = Score> constexpr S bishopMobility() const { return term<S>(6); }
+        template<typename S = Score> constexpr S rookVertMobility() const { return term<S>(7); }
+        template<typename S = Score> constexpr S rookHorMobility() const { return term<S>(8); }
+        template<typename S = Score> constexpr S doubledPawnPenalty() const { return term<S>(9); }
+        template<typename S = Score> constexpr S tripledPawnPenalty() const { return term<S>(10); }
+        template<typename S = Score> constexpr S isolatedPawnPenalty() const { return term<S>(11); }
+        template<typename S = Score> constexpr S passedPawnBonus(std::size_t rank) const { return term<S>(12 + rank - 1); }
+        template<typename S = Score> constexpr S closenessBonus(std::size_t pt) const { return term<S>(18 + (pt % 6)); }
+        template<typename S = Score> constexpr S knightPawnCountPenalty(std::size_t pawnCount) const { return term<S>(24 + (pawnCount / 4)); }
+        template<typename S = Score> constexpr S rookPawnCountBonus(std::size_t pawnCount) const { return term<S>(29 + (pawnCount / 4)); }
+        template<typename S = Score> constexpr S connectedRookBonus() const { return term<S>(34); }
+        template<typename S = Score> constexpr S doubledRookBonus() const { return term<S>(35); }
+        template<typename S = Score> constexpr S undefendedKnightPenalty() const { return term<S>(36); }
+        template<typename S = Score> constexpr S undefendedBishopPenalty() const { return term<S>(37); }
+        template<typename S = Score> constexpr S kingPassedPDistPenalty() const { return term<S>(38); }
+        template<typename S = Score> constexpr S rookBehindPassedP() const { return term<S>(39); }
+        template<typename S = Score> constexpr S pawnIslandPenalty() const { return term<S>(40); }
+        template<typename S = Score> constexpr S connectedPawnBonus() const { return term<S>(41); }
+        template<typename S = Score> constexpr S bishopOpenDiagBonus() const { return term<S>(42); }
+        template<typename S = Score> constexpr S rookOpenFileBonus() const { return term<S>(43); }
+        template<typename S = Score> constexpr S rookRank7Bonus() const { return term<S>(44); }
+        template<typename S = Score> constexpr S bishopPairBonus() const { return term<S>(45); }
+        template<typename S = Score> constexpr S kingCenterBonus() const { return term<S>(46); }
+        template<typename S = Score> constexpr S kingCenterRingBonus() const { return term<S>(47); }
+        template<typename S = Score> constexpr S knightOutpostBonus() const { return term<S>(48); }
+        template<typename S = Score> constexpr S kingAdjFileOpenPenalty() const { return term<S>(49); }
+        template<typename S = Score> constexpr S kingFileOpenPenalty() const { return term<S>(50); }
+        template<typename S = Score> constexpr S pawnShieldBonus() const { return term<S>(51); }
+        template<typename S = Score> constexpr S kingAttackerValue(std::size_t type) const { return term<S>(52 + type); }
+        template<typename S = Score> constexpr S backwardsPawnPenalty() const { return term<S>(57); }
+        static constexpr Eval tempoBonus() { return 10; } // Tempo not subject to tuning
+
+        std::array<Eval, 2 * termCount> evalTerms =
         { 93,256,276,440,1070,17,14,15,9,11,
+            111,-1,-24,-10,2,57,131,160,1,1,
+            2,3,3,1,-16,-12,-8,-4,0,16,
+            12,8,4,0,2,4,-8,-8,0,50,
+            -5,5,15,-14,37,27,0,0,17,18,
+            114,-1,27,33,22,64,70,27,
+            93,256,276,440,1070,17,14,15,9,11,
             111,-1,-24,-10,2,57,131,160,1,1,
             2,3,3,1,-16,-12,-8,-4,0,16,
             12,8,4,0,2,4,-8,-8,5,50,
-            -5,5,15,-14,37,27,17,14,17,18,
-            114,-1,27,33,22,64,70,27,};
+            -5,5,15,-14,37,27,17,14,17,0,
+            0,0,0,0,0,0,0,27,};
 
         using ParamListType = decltype(evalTerms);
 
+        // The lazy evaluation margin keeps only 1 / lazyMarginDivisor of the bound on the piece
+        // terms of both sides, since they mostly cancel. Larger values return lazy estimates more
+        // often and more of them land on the wrong side of the window. At least 1; 1 keeps the
+        // whole bound. Material tables built with another value have to be cleared.
+        int lazyMarginDivisor = 4;
+
     private:
         enum OutpostType {MyOutpost, OppOutpost};
 
-        unsigned totalMaterialValue(const board::QBB& b) const;
-
-        bool isEndgame(const board::QBB&) const;
-
-        constexpr Eval kingCentralization(board::square s) const
+        template<typename S = Score>
+        constexpr S kingCentralization(board::square s) const
         {
             if (aux::setbit(s) & constants::center)
-                return kingCenterBonus();
+                return kingCenterBonus<S>();
             else if (aux::setbit(s) & constants::centerRing)
-                return kingCenterRingBonus();
+                return kingCenterRingBonus<S>();
             else
-                return 0;
+                return S{};
         }
 
-        Eval kingSafety(const board::QBB& b, board::square myKing, board::square theirKing) const;
+        template<typename S = Score>
+        S kingSafety(const board::QBB& b, board::square myKing, board::square theirKing) const;
 
         constexpr std::pair<Bitboard, Bitboard> detectPassedPawns(Bitboard myPawns, Bitboard theirPawns) const
         {
@@ -153,7 +272,8 @@ namespace eval
             return std::make_pair(myPawns & ~theirPawnSpans, theirPawns & ~myPawnSpans);
         }
 
-        constexpr Eval aggressionBonus(board::square psq, board::square enemyKingSq, Eval bonus) const
+        template<typename S = Score>
+        constexpr S aggressionBonus(board::square psq, board::square enemyKingSq, S bonus) const
         {
             int pRank = rank(psq);
             int pFile = file(psq);
@@ -162,19 +282,50 @@ namespace eval
             return bonus * (7 - std::max(std::abs(pRank - kRank), std::abs(pFile - kFile)));
         }
 
-        Eval bishopOpenDiagonalBonus(Bitboard occ, Bitboard bishops) const;
+        Score bishopOpenDiagonalBonus(Bitboard occ, Bitboard bishops) const;
+
+        template<typename S = Score>
+        S rookOpenFileBonus(Bitboard pawns, Bitboard rooks) const;
+
+        template<typename S = Score>
+        S evalPawns(Bitboard myPawns, Bitboard theirPawns) const noexcept;
+
+        template<typename S = Score>
+        S evalPawns(const PawnSets&) const noexcept;
+
+        // piece values and the material imbalance terms
+        template<typename S = Score>
+        S materialScore(board::MaterialKey) const;
+
+        // everything but material and pawn structure
+        template<typename S = Score>
+        S positionalTerms(const board::QBB&, Bitboard myPassed, Bitboard theirPassed) const;
+
+        // endgame scale factor out of 64 for a position whose endgame score is eg
+        int egScale(const board::QBB&, const Tables::MaterialEntry&, int eg) const;
 
-        Eval rookOpenFileBonus(Bitboard pawns, Bitboard rooks) const;
+        // everything that depends only on the pawns, cached in the pawn hash table
+        Tables::PawnEntry pawnEntry(Bitboard myPawns, Bitboard theirPawns) const noexcept;
+        Tables::PawnEntry pawnEntry(const PawnSets&) const noexcept;
 
-        Eval evalPawns(Bitboard myPawns, Bitboard theirPawns) const noexcept;
+        Tables::MaterialEntry materialEntry(board::MaterialKey) const noexcept;
 
-        constexpr Eval bishopPairBonus(bool pair) const
+        // KBNK and KRKP, which the general evaluation doesn't know how to win or hold
+        Eval evaluateEndgame(const board::QBB&, const Tables::MaterialEntry&) const;
+
+        Eval evaluatePosition(const board::QBB&, const Tables::PawnEntry&, const Tables::MaterialEntry&) const;
+
+        const Tables::MaterialEntry& probeMaterial(const board::Board&, Tables::MaterialTable&) const;
+        const Tables::PawnEntry& probePawns(const board::Board&, Tables::PawnHashTable&) const;
+
+        template<typename S = Score>
+        constexpr S bishopPairBonus(bool pair) const
         {
-            return pair ? bishopPairBonus() : 0;
+            return pair ? bishopPairBonus<S>() : S{};
         }
 
-        template<OutpostType t>
-        Eval knightOutpostBonus(board::square knightsq, Bitboard myPawns, Bitboard enemyPawns) const
+        template<OutpostType t, typename S = Score>
+        S knightOutpostBonus(board::square knightsq, Bitboard myPawns, Bitboard enemyPawns) const
         {
             if constexpr (t == OutpostType::MyOutpost)
             {
@@ -185,10 +336,10 @@ namespace eval
                     myKnight = moves::pawnAttacks(myKnight);
                     if (!(myKnight & enemyPawns))
                     {
-                        return knightOutpostBonus();
+                        return knightOutpostBonus<S>();
                     }
                 }
-                return 0;
+                return S{};
             }
             else if constexpr (t == OutpostType::OppOutpost)
             {
@@ -199,29 +350,31 @@ namespace eval
                     myKnight = moves::enemyPawnAttacks(myKnight);
                     if (!(myKnight & myPawns))
                     {
-                        return knightOutpostBonus();
+                        return knightOutpostBonus<S>();
                     }
                 }
-                return 0;
+                return S{};
             }
         }
 
-        template<OutpostType ot>
-        Eval applyKnightOutPostBonus(Bitboard knights, Bitboard myPawns, Bitboard oppPawns) const
+        template<OutpostType ot, typename S = Score>
+        S applyKnightOutPostBonus(Bitboard knights, Bitboard myPawns, Bitboard oppPawns) const
         {
             GetNextBit<board::square> square(knights);
-            Eval e = 0;
+            S e{};
             while (square())
             {
                 auto sq = square.next;
-                e += knightOutpostBonus<ot>(sq, myPawns, oppPawns);
+                e += knightOutpostBonus<ot, S>(sq, myPawns, oppPawns);
             }
             return e;
         }
 
-        Eval applyAggressionBonus(std::size_t type, board::square enemyKingSq, Bitboard pieces) const;
+        template<typename S = Score>
+        S applyAggressionBonus(std::size_t type, board::square enemyKingSq, Bitboard pieces) const;
 
-        Eval apply7thRankBonus(Bitboard rooks, Bitboard rank) const;
+        template<typename S = Score>
+        S apply7thRankBonus(Bitboard rooks, Bitboard rank) const;
 
     public:
         friend struct EvaluatorGeneticOps;
@@ -229,12 +382,97 @@ namespace eval
 
         Eval operator()(const board::QBB&) const;
 
-        Eval materialBalance(const board::QBB& b) const;
+        // probes pawnTable and materialTable with the board's incrementally updated keys
+        Eval operator()(const board::Board&, Tables::PawnHashTable& pawnTable, Tables::MaterialTable& materialTable) const;
+
+        // Returns material and pawn structure alone, with lazy set, when they are further outside
+        // [alpha, beta] than the remaining terms are estimated to make up; otherwise the full
+        // evaluation. The margin is an estimate (see lazyMarginDivisor), not a strict bound, so
+        // a lazy result can occasionally land on the wrong side of the window.
+        Eval operator()(const board::Board&, Tables::PawnHashTable& pawnTable, Tables::MaterialTable& materialTable,
+            Eval alpha, Eval beta, bool& lazy) const;
+
+        // read from the material table, so O(1) on a hit
+        Eval materialBalance(const board::Board&, Tables::MaterialTable& materialTable) const;
+
+        // Evaluates every position of the batch into out, which must be as long as the batch.
+        // Chunks of the batch are evaluated in parallel, the pawn structures of four positions at
+        // a time with AVX2, and positions with the same material share one material table entry
+        // per chunk.
+        void operator()(const PositionBatch&, std::span<Eval> out) const;
+
+        // the evaluation of b as a linear function of evalTerms, for gradient based tuning
+        EvalTrace trace(const board::QBB& b) const;
 
         constexpr Evaluator() {}
         std::string asString() const;
     };
 
+    // A Score that also carries how much every term contributed to it. Evaluating with it
+    // instead of Score gives each term's coefficient in the evaluation.
+    struct TracedScore
+    {
+        Score value;
+        std::array<float, Evaluator::termCount> coefficients{};
+
+        static TracedScore unit(std::size_t term, Score value)
+        {
+            TracedScore s{ value };
+            s.coefficients[term] = 1;
+            return s;
+        }
+
+        TracedScore& operator+=(const TracedScore& s) noexcept
+        {
+            value += s.value;
+            for (std::size_t i = 0; i != coefficients.size(); ++i)
+                coefficients[i] += s.coefficients[i];
+            return *this;
+        }
+
+        TracedScore& operator-=(const TracedScore& s) noexcept
+        {
+            value -= s.value;
+            for (std::size_t i = 0; i != coefficients.size(); ++i)
+                coefficients[i] -= s.coefficients[i];
+            return *this;
+        }
+    };
+
+    inline TracedScore operator+(TracedScore a, const TracedScore& b) noexcept { return a += b; }
+    inline TracedScore operator-(TracedScore a, const TracedScore& b) noexcept { return a -= b; }
+    inline TracedScore operator-(TracedScore a) noexcept { return TracedScore{} - a; }
+
+    template<typename T> requires std::is_arithmetic_v<T>
+    TracedScore operator*(TracedScore s, T t) noexcept
+    {
+        // the value is rounded exactly like a Score so traced and plain evaluations agree
+        s.value = s.value * t;
+        for (auto& c : s.coefficients)
+            c = static_cast<float>(c * t);
+        return s;
+    }
+
+    template<typename T> requires std::is_arithmetic_v<T>
+    TracedScore operator*(T t, TracedScore s) noexcept
+    {
+        return s * t;
+    }
+
+    // The evaluation of one position as tempoBonus() plus, for every term i,
+    // coefficients[i] * (mg_i * phase + eg_i * (maxPhase - phase) * egScale) / maxPhase.
+    // Nonlinear parts such as king safety scaling are frozen at the traced evaluator's values.
+    struct EvalTrace
+    {
+        std::array<float, Evaluator::termCount> coefficients{};
+        int phase = 0;
+        double egScale = 1;
+        // the evaluator's own result for the position
+        Eval eval = 0;
+        // false for endgames with their own evaluation function, which no trace describes
+        bool linear = true;
+    };
+
     struct EvaluatorGeneticOps
     {
         void mutate(Evaluator&, double mutation_rate);
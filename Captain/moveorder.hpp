@@ -19,6 +19,10 @@ along with this program. If not, see <https://www.gnu.org/licenses/>.
 #ifndef CAPTAIN_MOVE_ORDER_HPP
 #define CAPTAIN_MOVE_ORDER_HPP
 
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+
 #include "tables.hpp"
 #include "board.hpp"
 #include "moves.hpp"
@@ -26,23 +30,49 @@ along with this program. If not, see <https://www.gnu.org/licenses/>.
 
 namespace moves
 {
+    // Insertion sort (descending) of only the moves scoring at least limit.
+    // Those moves end up at the front of [begin, end) in order, while the rest
+    // are left behind them in generation order. Returns the end of the sorted part.
+    template<typename It>
+    It partialInsertionSort(It begin, It end, std::int16_t limit)
+    {
+        auto sortedEnd = begin;
+        for (auto p = begin; p != end; ++p)
+        {
+            if (p->score >= limit)
+            {
+                const ScoredMove tmp = *p;
+                // shifting the unsorted moves up by one, rather than swapping, keeps their order
+                std::move_backward(sortedEnd, p, p + 1);
+                auto q = sortedEnd;
+                for (; q != begin && *(q - 1) < tmp; --q)
+                {
+                    *q = *(q - 1);
+                }
+                *q = tmp;
+                ++sortedEnd;
+            }
+        }
+        return sortedEnd;
+    }
+
     class MoveOrder
     {
     public:
-        MoveOrder(Tables::KillerTable* _kt, Tables::HistoryTable* _ht, std::uint64_t h, std::size_t depth)
-            :kt(_kt), ht(_ht), hash(h), d(depth) {}
+        MoveOrder(Tables::TTable* _tt, Tables::KillerTable* _kt, Tables::HistoryTable* _ht, std::uint64_t h, std::size_t depth)
+            :tt(_tt), kt(_kt), ht(_ht), hash(h), d(depth) {}
         bool next(const board::QBB& b, Move& m)
         {
             switch (stage)
             {
             case Stage::hash:
-                hashmove = Tables::tt[hash].move;
+                hashmove = (*tt)[hash].move;
                 if (kt)
                 {
                     k1move = kt->getKiller(d, 0);
                     k2move = kt->getKiller(d, 1);
                 }
-                if (Tables::tt[hash].key == hash && hashmove)
+                if ((*tt)[hash].key == hash && hashmove)
                 {
                     if (isLegalMove(b, hashmove))
                     {
@@ -63,34 +93,23 @@ namespace moves
                 }
                 captureBegin = ml.begin();
                 captureEnd = ml.end();
-                stage = ml.size() ? Stage::captureStage : Stage::killer1Stage;
+                losingCapturesBegin = partialInsertionSort(captureBegin, captureEnd, 0);
+                partialInsertionSort(losingCapturesBegin, captureEnd, std::numeric_limits<std::int16_t>::min());
+                stage = Stage::captureStage;
                 [[fallthrough]];
             case Stage::captureStage:
-                if (captureBegin == captureEnd)
-                {
-                    stage = Stage::killer1Stage;
-                }
-                else
+                if (captureBegin != losingCapturesBegin)
                 {
-                    auto bestCapture = std::max_element(captureBegin, captureEnd);
-                    if (bestCapture->score < 0)
-                    {
-                        losingCapturesBegin = captureBegin;
-                        stage = Stage::killer1Stage;
-                    }
-                    else
-                    {
-                        std::iter_swap(captureBegin, bestCapture);
-                        m = captureBegin->m;
-                        ++captureBegin;
-                        stageReturned = Stage::captureStage;
-                        return true;
-                    }
+                    m = captureBegin->m;
+                    ++captureBegin;
+                    stageReturned = Stage::captureStage;
+                    return true;
                 }
+                stage = Stage::killer1Stage;
                 [[fallthrough]];
             case Stage::killer1Stage:
                 stage = Stage::killer2Stage;
-                if (k1move != hashmove && isLegalMove(b, k1move))
+                if (!skipQuiet && k1move != hashmove && isLegalMove(b, k1move))
                 {
                     m = k1move;
                     stageReturned = Stage::killer1Stage;
@@ -99,7 +118,7 @@ namespace moves
                 [[fallthrough]];
             case Stage::killer2Stage:
                 stage = Stage::quietsGen;
-                if (k2move != hashmove && isLegalMove(b, k2move))
+                if (!skipQuiet && k2move != hashmove && isLegalMove(b, k2move))
                 {
                     m = k2move;
                     stageReturned = Stage::killer2Stage;
@@ -108,29 +127,31 @@ namespace moves
                 [[fallthrough]];
             case Stage::quietsGen:
                 quietsCurrent = captureEnd;
-                genMoves<!QSearch, Quiets>(b, ml);
-                ml.remove_moves_if(quietsCurrent, ml.end(), [this](ScoredMove k) {return k.m == hashmove || k.m == k1move || k.m == k2move; });
-                for (auto i = quietsCurrent; i != ml.end(); ++i)
+                if (!skipQuiet)
                 {
-                    i->score = ht->getHistoryScore(b.getPieceCodeIdx(board::getMoveFromSq(i->m)), board::getMoveToSq(i->m));
+                    genMoves<!QSearch, Quiets>(b, ml);
+                    ml.remove_moves_if(quietsCurrent, ml.end(), [this](ScoredMove k) {return k.m == hashmove || k.m == k1move || k.m == k2move; });
+                    for (auto i = quietsCurrent; i != ml.end(); ++i)
+                    {
+                        i->score = ht->getHistoryScore(b.getPieceCodeIdx(board::getMoveFromSq(i->m)), board::getMoveToSq(i->m));
+                    }
+                    // moves that failed before go last, best first, like the losing captures
+                    const auto unsortedQuiets = partialInsertionSort(quietsCurrent, ml.end(), quietSortThreshold);
+                    const auto failedQuiets = partialInsertionSort(unsortedQuiets, ml.end(), 0);
+                    partialInsertionSort(failedQuiets, ml.end(), std::numeric_limits<std::int16_t>::min());
                 }
                 quietsEnd = ml.end();
                 stage = Stage::quiets;
                 [[fallthrough]];
             case Stage::quiets:
-                if (quietsCurrent == quietsEnd)
-                {
-                    stage = Stage::losingCaptures;
-                }
-                else
+                if (!skipQuiet && quietsCurrent != quietsEnd)
                 {
-                    auto max = std::max_element(quietsCurrent, quietsEnd);
-                    std::iter_swap(quietsCurrent, max);
                     m = quietsCurrent->m;
                     ++quietsCurrent;
                     stageReturned = Stage::quiets;
                     return true;
                 }
+                stage = Stage::losingCaptures;
                 [[fallthrough]];
             case Stage::losingCaptures:
                 if (losingCapturesBegin == captureEnd)
@@ -148,7 +169,16 @@ namespace moves
                 return false;
             }
         }
+        // Stop returning killers and quiets. If the quiets were not
+        // generated yet they never will be.
+        void skipQuiets() noexcept
+        {
+            skipQuiet = true;
+        }
     private:
+        // quiets with no history are not worth sorting, search them in generation order
+        // between those with positive and negative history
+        static constexpr std::int16_t quietSortThreshold = 1;
         MoveOrder() {}
         Movelist<ScoredMove, 218> ml;
         decltype(ml.begin()) captureBegin = ml.begin();
@@ -156,6 +186,7 @@ namespace moves
         decltype(ml.begin()) quietsCurrent;
         decltype(ml.begin()) quietsEnd;
         decltype(ml.begin()) losingCapturesBegin = ml.begin();
+        Tables::TTable* tt = &Tables::tt;
         Tables::KillerTable* kt = nullptr;
         Tables::HistoryTable* ht = nullptr;
         std::uint64_t hash = 0;
@@ -164,6 +195,7 @@ namespace moves
         Move hashmove = 0;
         Move k1move = 0;
         Move k2move = 0;
+        bool skipQuiet = false;
     public:
         Stage stageReturned = Stage::none;
 
@@ -0,0 +1,235 @@
+/*
+Copyright 2022-2023, Narbeh Mouradian
+
+Captain is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Captain is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <immintrin.h>
+
+#include <fstream>
+#include <algorithm>
+#include <iterator>
+
+#include "nnue.hpp"
+#include "auxiliary.hpp"
+
+namespace nnue
+{
+    namespace
+    {
+        // accumulators this many positions behind are refreshed instead of updated
+        constexpr std::size_t maxUpdateDistance = 8;
+
+        // white pawns to kings, then black pawns to kings, all from white's side of the board
+        std::array<Bitboard, 12> whitePieces(const board::QBB& b)
+        {
+            const std::array<Bitboard, 6> types = {
+                b.getPawns(), b.getKnights(), b.getBishops(), b.getRooks(), b.getQueens(), b.getKings() };
+            const bool white = b.isWhiteToPlay();
+            std::array<Bitboard, 12> pieces;
+            for (std::size_t i = 0; i != types.size(); ++i)
+            {
+                Bitboard mine = b.my(types[i]);
+                Bitboard theirs = b.their(types[i]);
+                // the board is flipped when black is to move
+                if (!white)
+                {
+                    mine = _byteswap_uint64(mine);
+                    theirs = _byteswap_uint64(theirs);
+                }
+                pieces[i] = white ? mine : theirs;
+                pieces[6 + i] = white ? theirs : mine;
+            }
+            return pieces;
+        }
+
+        // piece is an index into whitePieces, square is from white's side
+        constexpr std::size_t whiteFeature(std::size_t piece, unsigned square)
+        {
+            return piece * 64 + square;
+        }
+
+        // the same piece seen by black: colours swapped and the board mirrored
+        constexpr std::size_t blackFeature(std::size_t piece, unsigned square)
+        {
+            return ((piece + 6) % 12) * 64 + (square ^ 56);
+        }
+
+        void addFeature(std::array<std::int16_t, hidden>& acc, const std::int16_t* weights)
+        {
+#if defined(__AVX2__)
+            for (std::size_t i = 0; i != hidden; i += 16)
+            {
+                const auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&acc[i]));
+                const auto w = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(weights + i));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(&acc[i]), _mm256_add_epi16(a, w));
+            }
+#else
+            for (std::size_t i = 0; i != hidden; ++i)
+                acc[i] += weights[i];
+#endif
+        }
+
+        void subFeature(std::array<std::int16_t, hidden>& acc, const std::int16_t* weights)
+        {
+#if defined(__AVX2__)
+            for (std::size_t i = 0; i != hidden; i += 16)
+            {
+                const auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&acc[i]));
+                const auto w = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(weights + i));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(&acc[i]), _mm256_sub_epi16(a, w));
+            }
+#else
+            for (std::size_t i = 0; i != hidden; ++i)
+                acc[i] -= weights[i];
+#endif
+        }
+
+        // sum of clipped activations times output weights, in units of activationMax * outputWeightScale
+        std::int32_t dot(const std::array<std::int16_t, hidden>& acc, const std::int8_t* weights)
+        {
+#if defined(__AVX2__)
+            const auto zero = _mm256_setzero_si256();
+            const auto max = _mm256_set1_epi16(activationMax);
+            const auto ones = _mm256_set1_epi16(1);
+            auto sum = _mm256_setzero_si256();
+            for (std::size_t i = 0; i != hidden; i += 32)
+            {
+                auto lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&acc[i]));
+                auto hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&acc[i + 16]));
+                lo = _mm256_min_epi16(_mm256_max_epi16(lo, zero), max);
+                hi = _mm256_min_epi16(_mm256_max_epi16(hi, zero), max);
+                // packing interleaves the 128 bit lanes, the permute puts the activations back in order
+                const auto activations = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0b11011000);
+                const auto w = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(weights + i));
+                // activations and weights are at most 127 in magnitude, so the pairwise sums can't saturate
+                const auto products = _mm256_maddubs_epi16(activations, w);
+                sum = _mm256_add_epi32(sum, _mm256_madd_epi16(products, ones));
+            }
+            auto sum128 = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+            sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, 0b01001110));
+            sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, 0b10110001));
+            return _mm_cvtsi128_si32(sum128);
+#else
+            std::int32_t sum = 0;
+            for (std::size_t i = 0; i != hidden; ++i)
+                sum += std::clamp<std::int32_t>(acc[i], 0, activationMax) * weights[i];
+            return sum;
+#endif
+        }
+    }
+
+    std::shared_ptr<const Network> Network::load(const std::string& filename)
+    {
+        std::ifstream file{ filename, std::ios::binary };
+        if (!file)
+            return nullptr;
+
+        auto network = std::make_shared<Network>();
+        auto read = [&file](auto* data, std::size_t count) {
+            file.read(reinterpret_cast<char*>(data), count * sizeof(*data));
+        };
+        read(network->featureWeights.data(), network->featureWeights.size());
+        read(network->featureBiases.data(), network->featureBiases.size());
+        read(network->outputWeights.data(), network->outputWeights.size());
+        read(&network->outputBias, 1);
+
+        // a short read fails the stream, trailing data means the file is for another architecture
+        if (!file || file.peek() != std::ifstream::traits_type::eof())
+            return nullptr;
+        return network;
+    }
+
+    void Network::refresh(Accumulator& acc, const board::QBB& b) const
+    {
+        acc.white = featureBiases;
+        acc.black = featureBiases;
+        const auto pieces = whitePieces(b);
+        for (std::size_t piece = 0; piece != pieces.size(); ++piece)
+        {
+            aux::GetNextBit<unsigned> square(pieces[piece]);
+            while (square())
+            {
+                addFeature(acc.white, &featureWeights[whiteFeature(piece, square.next) * hidden]);
+                addFeature(acc.black, &featureWeights[blackFeature(piece, square.next) * hidden]);
+            }
+        }
+    }
+
+    void Network::update(const Accumulator& before, Accumulator& after, const board::QBB& b1, const board::QBB& b2) const
+    {
+        after.white = before.white;
+        after.black = before.black;
+        const auto pieces1 = whitePieces(b1);
+        const auto pieces2 = whitePieces(b2);
+        // comparing whole boards covers castling, en passant and promotions without special cases
+        for (std::size_t piece = 0; piece != pieces1.size(); ++piece)
+        {
+            aux::GetNextBit<unsigned> removed(pieces1[piece] & ~pieces2[piece]);
+            while (removed())
+            {
+                subFeature(after.white, &featureWeights[whiteFeature(piece, removed.next) * hidden]);
+                subFeature(after.black, &featureWeights[blackFeature(piece, removed.next) * hidden]);
+            }
+            aux::GetNextBit<unsigned> added(pieces2[piece] & ~pieces1[piece]);
+            while (added())
+            {
+                addFeature(after.white, &featureWeights[whiteFeature(piece, added.next) * hidden]);
+                addFeature(after.black, &featureWeights[blackFeature(piece, added.next) * hidden]);
+            }
+        }
+    }
+
+    Eval Network::output(const Accumulator& acc, bool whiteToPlay) const
+    {
+        const auto& us = whiteToPlay ? acc.white : acc.black;
+        const auto& them = whiteToPlay ? acc.black : acc.white;
+        const std::int64_t sum = std::int64_t{ outputBias }
+            + dot(us, outputWeights.data())
+            + dot(them, outputWeights.data() + hidden);
+        const auto eval = sum * evalScale / (activationMax * outputWeightScale);
+        return static_cast<Eval>(std::clamp<std::int64_t>(eval, -maxEval, maxEval));
+    }
+
+    Eval Network::operator()(const board::Board& b, std::vector<Accumulator>& stack) const
+    {
+        const std::size_t top = b.boards.size() - 1;
+        if (stack.size() < b.boards.size())
+            stack.resize(b.boards.size());
+
+        auto matches = [&](std::size_t i) { return stack[i].valid && stack[i].key == b.hashes[i]; };
+
+        std::size_t first = top;
+        while (!matches(first) && first != 0 && top - first < maxUpdateDistance)
+            --first;
+
+        if (!matches(first))
+        {
+            first = top;
+            refresh(stack[top], b.boards[top]);
+            stack[top].key = b.hashes[top];
+            stack[top].valid = true;
+        }
+
+        for (std::size_t i = first + 1; i <= top; ++i)
+        {
+            update(stack[i - 1], stack[i], b.boards[i - 1], b.boards[i]);
+            stack[i].key = b.hashes[i];
+            stack[i].valid = true;
+        }
+
+        return output(stack[top], b.boards[top].isWhiteToPlay());
+    }
+}
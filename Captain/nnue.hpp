@@ -0,0 +1,81 @@
+/*
+Copyright 2022-2023, Narbeh Mouradian
+
+Captain is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Captain is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef NNUE_H
+#define NNUE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <vector>
+#include <string>
+#include <memory>
+
+#include "board.hpp"
+#include "types.hpp"
+
+namespace nnue
+{
+    // One input per (colour, piece type, square), once from white's side of the board and
+    // once from black's. Both halves feed the same hidden layer, the side to move's first.
+    constexpr std::size_t inputs = 2 * 6 * 64;
+    constexpr std::size_t hidden = 256;
+
+    // Hidden activations are clipped to [0, activationMax] and multiplied by int8 output
+    // weights quantized by outputWeightScale; evalScale converts the result to centipawns.
+    constexpr int activationMax = 127;
+    constexpr int outputWeightScale = 64;
+    constexpr int evalScale = 400;
+    // keeps network output well clear of mate scores
+    constexpr int maxEval = 4000;
+
+    // The hidden layer before activation, for one position and both perspectives.
+    // key is the hash of the position it was computed for.
+    struct alignas(32) Accumulator
+    {
+        std::array<std::int16_t, hidden> white;
+        std::array<std::int16_t, hidden> black;
+        Hash key = 0;
+        bool valid = false;
+    };
+
+    class Network
+    {
+        // feature weights are stored input by input, hidden values of one input contiguous
+        std::vector<std::int16_t> featureWeights = std::vector<std::int16_t>(inputs * hidden);
+        std::array<std::int16_t, hidden> featureBiases{};
+        // side to move's half first
+        std::array<std::int8_t, 2 * hidden> outputWeights{};
+        std::int32_t outputBias = 0;
+
+        void refresh(Accumulator&, const board::QBB&) const;
+        void update(const Accumulator& before, Accumulator& after, const board::QBB& b1, const board::QBB& b2) const;
+        Eval output(const Accumulator&, bool whiteToPlay) const;
+    public:
+        // Reads feature weights, feature biases, output weights and the output bias, in that
+        // order, little-endian and without padding. Returns nullptr if the file can't be read
+        // or has the wrong size.
+        static std::shared_ptr<const Network> load(const std::string& filename);
+
+        // Evaluates the last position of b from the side to move's point of view. The stack
+        // holds one accumulator per position of b; it's brought up to date from the closest
+        // position whose accumulator is still valid, so unmaking a move costs nothing.
+        Eval operator()(const board::Board& b, std::vector<Accumulator>& stack) const;
+    };
+}
+#endif
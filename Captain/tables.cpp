@@ -70,12 +70,14 @@ namespace Tables
 
     bool TTable::isBetterEntry(const Entry& curr, std::int16_t depth, unsigned char age)
     {
-        if (curr.age < age)
+        if (curr.age == 0)
         {
             return true;
         }
 
-        return curr.depth < depth;
+        // generations run from 1 to 255 and wrap around
+        const int distance = (age - curr.age + 255) % 255;
+        return curr.depth - agePenalty * distance < depth;
     }
 
     void TTable::tryStore(std::uint64_t hash, std::int16_t depth, Eval eval, Move m, char nodetype, unsigned char age, bool anyPruning)
@@ -133,6 +135,12 @@ namespace Tables
         }
     }
 
+    void TTable::nextGeneration() noexcept
+    {
+        if (!++generation)
+            generation = 1;
+    }
+
     Entry& TTable::operator[](std::uint64_t hash) noexcept
     {
         return table[hash % sz];
@@ -210,21 +218,4 @@ namespace Tables
         return sz ? static_cast<double>(used * 100) / sz : 0;
     }
     */
-
-    std::uint64_t PawnHashTable::initialHash(Bitboard pawns) const noexcept
-    {
-        std::uint64_t hash = 0;
-        aux::GetNextBit<board::square> nextpawn(pawns);
-        while (nextpawn())
-        {
-            hash ^= pawnpositions[nextpawn.next];
-        }
-        return hash;
-    }
-
-    std::uint64_t PawnHashTable::incrementalUpdate(Bitboard pawnsOld, Bitboard pawnsNew) const noexcept
-    {
-        auto change = pawnsOld ^ pawnsNew;
-        return initialHash(change);
-    }
 }
\ No newline at end of file
@@ -22,6 +22,8 @@ along with this program. If not, see <https://www.gnu.org/licenses/>.
 #include <cstdint>
 #include <array>
 #include <algorithm>
+#include <cstdlib>
+#include <vector>
 
 #include "types.hpp"
 
@@ -43,6 +45,10 @@ namespace Tables
     {
         Entry* table = nullptr;
         std::size_t sz = 0;
+        // 0 marks an empty entry
+        unsigned char generation = 1;
+        // plies of depth an entry is worth less for every generation since it was stored
+        static constexpr int agePenalty = 2;
 
         void initRandom();
         static bool isBetterEntry(const Entry& curr, std::int16_t depth, unsigned char age);
@@ -59,6 +65,11 @@ namespace Tables
         ~TTable();
         
         void clear();
+
+        // entries from earlier searches or games count as shallower the older they are, so they
+        // are replaced sooner but stay probeable without the cost of clearing the table
+        void nextGeneration() noexcept;
+        unsigned char getGeneration() const noexcept { return generation; }
         
         void tryStore(std::uint64_t hash, std::int16_t depth, Eval eval, Move m, char nodetype, unsigned char age, bool anyPruning);
         void store(std::uint64_t hash, std::int16_t depth, Eval eval, Move m, char nodetype, unsigned char age);
@@ -78,31 +89,110 @@ namespace Tables
 
     extern TTable tt;
 
+    // pawn structure evaluation from the side to move's point of view
     struct PawnEntry
     {
-        Bitboard myPawns = 0;
-        Bitboard theirPawns = 0;
-        Eval eval = 0;
-        constexpr bool valid(Bitboard mine, Bitboard theirs) const noexcept
+        Hash key = 0;
+        Bitboard myPassed = 0;
+        Bitboard theirPassed = 0;
+        Eval mg = 0;
+        Eval eg = 0;
+    };
+
+    class PawnHashTable
+    {
+        std::vector<PawnEntry> entries;
+    public:
+        std::size_t probes = 0;
+        std::size_t hits = 0;
+
+        // long searches come back to structures that a 1 MB table had already evicted
+        PawnHashTable() : entries((4 * 1024 * 1024) / sizeof(PawnEntry)) {}
+
+        PawnEntry& operator[](Hash hash) noexcept
         {
-            return myPawns == mine && theirPawns == theirs;
+            return entries[hash % entries.size()];
+        }
+
+        void clear()
+        {
+            std::fill(entries.begin(), entries.end(), PawnEntry{});
+            probes = 0;
+            hits = 0;
         }
     };
 
-    class PawnHashTable
+    // material dependent evaluation for one material signature, from the side to move's point of view
+    struct MaterialEntry
+    {
+        enum Endgame : std::uint8_t { None, KBNK, KRKP };
+
+        std::uint64_t key = ~0ULL;
+        Eval mg = 0;
+        Eval eg = 0;
+        // piece values alone, already tapered
+        Eval balance = 0;
+        std::uint8_t phase = 0;
+        // endgame scale factors out of 64, used when the corresponding side is ahead
+        std::uint8_t myScale = 64;
+        std::uint8_t theirScale = 64;
+        Endgame endgame = None;
+        bool strongSideIsMine = true;
+        // one bishop each and no other pieces; drawish if the bishops turn out to be on opposite colours
+        bool oppositeBishopsCandidate = false;
+        // how far the terms beyond material and pawn structure can move the evaluation
+        Eval lazyMargin = 0;
+    };
+
+    class MaterialTable
     {
-        std::array<PawnEntry, (1024 * 1024) / sizeof(PawnEntry)> entries;
-        std::array<std::uint64_t, 64> pawnpositions;
+        std::vector<MaterialEntry> entries;
     public:
-        constexpr PawnEntry& operator[](std::uint64_t hash) noexcept
+        std::size_t probes = 0;
+        std::size_t hits = 0;
+
+        MaterialTable() : entries(8192) {}
+
+        // material keys are packed counts, not random, so mix them before indexing
+        MaterialEntry& operator[](std::uint64_t key) noexcept
+        {
+            return entries[((key * 0x9E3779B97F4A7C15ULL) >> 32) % entries.size()];
+        }
+
+        void clear()
+        {
+            std::fill(entries.begin(), entries.end(), MaterialEntry{});
+            probes = 0;
+            hits = 0;
+        }
+    };
+
+    // static evaluations of whole positions, keyed by the position's hash
+    struct EvalEntry
+    {
+        Hash key = 0;
+        Eval eval = 0;
+    };
+
+    class EvalCache
+    {
+        std::vector<EvalEntry> entries;
+    public:
+        std::size_t probes = 0;
+        std::size_t hits = 0;
+
+        EvalCache() : entries((1024 * 1024) / sizeof(EvalEntry)) {}
+
+        EvalEntry& operator[](Hash hash) noexcept
         {
             return entries[hash % entries.size()];
         }
-        std::uint64_t initialHash(Bitboard pawns) const noexcept;
-        std::uint64_t incrementalUpdate(Bitboard pawnsOld, Bitboard pawnsNew) const noexcept;
-        constexpr void clear()
+
+        void clear()
         {
-            entries.fill(PawnEntry{.myPawns = 0, .theirPawns = 0, .eval = 0});
+            std::fill(entries.begin(), entries.end(), EvalEntry{});
+            probes = 0;
+            hits = 0;
         }
     };
 
@@ -145,8 +235,9 @@ namespace Tables
 
     class HistoryTable
     {
-        std::array<std::array<std::uint32_t, 64>, 6> history;
+        std::array<std::array<std::int16_t, 64>, 6> history;
     public:
+        static constexpr int maxHistory = 16384;
         HistoryTable()
         {
             for (auto& i : history)
@@ -157,15 +248,17 @@ namespace Tables
                 }
             }
         }
-        constexpr std::int16_t getHistoryScore(unsigned int pieceCodeIdx, board::square to)
+        constexpr std::int16_t getHistoryScore(unsigned int pieceCodeIdx, board::square to) const
         {
-            auto score = history[pieceCodeIdx][to];
-            score = std::clamp(score, 0U, static_cast<unsigned>(std::numeric_limits<std::int16_t>::max()));
-            return static_cast<std::int16_t>(score);
+            return history[pieceCodeIdx][to];
         }
-        constexpr void updateHistory(unsigned int pieceCodeIdx, board::square to, int depth)
+        // bonus is positive for moves that caused a cutoff and negative for
+        // quiets tried before them; scores saturate towards +/- maxHistory
+        constexpr void updateHistory(unsigned int pieceCodeIdx, board::square to, int bonus)
         {
-            history[pieceCodeIdx][to] += depth * depth;
+            auto& entry = history[pieceCodeIdx][to];
+            bonus = std::clamp(bonus, -maxHistory, maxHistory);
+            entry += static_cast<std::int16_t>(bonus - entry * std::abs(bonus) / maxHistory);
         }
     };
 
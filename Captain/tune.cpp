@@ -20,18 +20,177 @@ along with this program. If not, see <https://www.gnu.org/licenses/>.
 #include <execution>
 #include <random>
 #include <cstddef>
+#include <cstdint>
 #include <chrono>
 #include <cmath>
 #include <fstream>
 #include <limits>
+#include <numeric>
+#include <functional>
 
 #include "tune.hpp"
 #include "engine.hpp"
 #include "tables.hpp"
 #include "auxiliary.hpp"
-#include "searchflags.hpp"
 
 namespace Tuning
 {
+    namespace
+    {
+        // positions per task when summing the gradient in parallel
+        constexpr std::size_t gradientChunk = 4096;
 
+        constexpr double beta1 = 0.9;
+        constexpr double beta2 = 0.999;
+        constexpr double epsilon = 1e-8;
+    }
+
+    ScoredPositions quiet_leaves(const eval::Evaluator& e, std::span<const dataset::Record> positions)
+    {
+        ScoredPositions leaves(positions.size());
+        std::vector<std::uint8_t> mated(positions.size());
+        std::vector<std::size_t> indices(positions.size());
+        std::iota(indices.begin(), indices.end(), std::size_t{ 0 });
+
+        engine::SearchSettings ss;
+        ss.quiet = true;
+        ss.ignoreSearchFlags = true;
+        engine::EnginePool pool{ e, ss };
+
+        std::for_each(std::execution::par, indices.cbegin(), indices.cend(), [&](std::size_t i) {
+            const board::QBB pos = positions[i].position();
+            const double result = positions[i].result;
+            auto& eng = pool.engine();
+            eng.newSearch(pos, std::chrono::steady_clock::now());
+            engine::PrincipalVariation pv;
+            const Eval score = eng.quiesceSearch(engine::rootMinBound, engine::rootMaxBound, 0, &pv);
+            // no static evaluation describes a mated leaf
+            mated[i] = engine::isMateScore(score);
+            board::QBB leaf = pos;
+            bool flipped = false;
+            for (const auto m : pv)
+            {
+                leaf.makeMove(m);
+                flipped = !flipped;
+            }
+            // results are from the side to move's point of view, like evaluations
+            leaves[i] = std::make_pair(leaf, flipped ? 1 - result : result);
+            });
+
+        std::size_t kept = 0;
+        for (std::size_t i = 0; i != leaves.size(); ++i)
+            if (!mated[i])
+                leaves[kept++] = leaves[i];
+        leaves.resize(kept);
+        return leaves;
+    }
+
+    std::vector<TracedPosition> trace_positions(const eval::Evaluator& e, const ScoredPositions& positions)
+    {
+        std::vector<TracedPosition> traced(positions.size());
+        std::transform(std::execution::par, positions.cbegin(), positions.cend(), traced.begin(), [&e](const auto& x) {
+            return TracedPosition{ e.trace(x.first), x.second };
+            });
+        std::erase_if(traced, [](const TracedPosition& p) { return !p.trace.linear; });
+        return traced;
+    }
+
+    double linear_error(const std::vector<TracedPosition>& positions, const eval::Evaluator& e, double K)
+    {
+        GradientTuner t{ positions, e, K };
+        return t.error();
+    }
+
+    GradientTuner::GradientTuner(const std::vector<TracedPosition>& positions, const eval::Evaluator& start, double K)
+        : positions(positions), K(K)
+    {
+        std::copy(start.evalTerms.cbegin(), start.evalTerms.cend(), params.begin());
+    }
+
+    double GradientTuner::evaluate(const eval::EvalTrace& t) const
+    {
+        constexpr std::size_t termCount = eval::Evaluator::termCount;
+        const double egWeight = (eval::maxPhase - t.phase) * t.egScale;
+        double mg = 0;
+        double eg = 0;
+        for (std::size_t i = 0; i != termCount; ++i)
+        {
+            mg += t.coefficients[i] * params[i];
+            eg += t.coefficients[i] * params[termCount + i];
+        }
+        return eval::Evaluator::tempoBonus() + (mg * t.phase + eg * egWeight) / eval::maxPhase;
+    }
+
+    double GradientTuner::error() const
+    {
+        const double sum = std::transform_reduce(std::execution::par, positions.cbegin(), positions.cend(), 0.0, std::plus<>(),
+            [this](const TracedPosition& p) {
+                const double tmp = p.result - aux::sigmoid(K, evaluate(p.trace));
+                return tmp * tmp;
+            });
+        return sum / std::max<std::size_t>(positions.size(), 1);
+    }
+
+    // dError/dTerm summed over the positions: the error's derivative by the evaluation,
+    // -2 (result - s) * s (1 - s) * K ln(10) / 400, times the evaluation's derivative by the term,
+    // the trace coefficient weighted by the phase
+    GradientTuner::Params GradientTuner::gradient() const
+    {
+        constexpr std::size_t termCount = eval::Evaluator::termCount;
+        const std::size_t chunks = (positions.size() + gradientChunk - 1) / gradientChunk;
+        std::vector<Params> partial(chunks);
+        std::vector<std::size_t> indices(chunks);
+        std::iota(indices.begin(), indices.end(), std::size_t{ 0 });
+
+        std::for_each(std::execution::par, indices.cbegin(), indices.cend(), [&](std::size_t chunk) {
+            Params g{};
+            const auto first = positions.cbegin() + chunk * gradientChunk;
+            const auto last = positions.cbegin() + std::min(positions.size(), (chunk + 1) * gradientChunk);
+            for (auto p = first; p != last; ++p)
+            {
+                const auto& t = p->trace;
+                const double s = aux::sigmoid(K, evaluate(t));
+                const double dEval = -2 * (p->result - s) * s * (1 - s) * K * std::log(10.0) / 400;
+                const double mgWeight = dEval * t.phase / eval::maxPhase;
+                const double egWeight = dEval * (eval::maxPhase - t.phase) * t.egScale / eval::maxPhase;
+                for (std::size_t i = 0; i != termCount; ++i)
+                {
+                    g[i] += t.coefficients[i] * mgWeight;
+                    g[termCount + i] += t.coefficients[i] * egWeight;
+                }
+            }
+            partial[chunk] = g;
+            });
+
+        Params g{};
+        for (const auto& p : partial)
+            for (std::size_t i = 0; i != g.size(); ++i)
+                g[i] += p[i];
+        for (auto& i : g)
+            i /= std::max<std::size_t>(positions.size(), 1);
+        return g;
+    }
+
+    void GradientTuner::step(double learningRate)
+    {
+        const Params g = gradient();
+        ++steps;
+        const double correction1 = 1 - std::pow(beta1, static_cast<double>(steps));
+        const double correction2 = 1 - std::pow(beta2, static_cast<double>(steps));
+        for (std::size_t i = 0; i != params.size(); ++i)
+        {
+            m[i] = beta1 * m[i] + (1 - beta1) * g[i];
+            v[i] = beta2 * v[i] + (1 - beta2) * g[i] * g[i];
+            params[i] -= learningRate * (m[i] / correction1) / (std::sqrt(v[i] / correction2) + epsilon);
+        }
+    }
+
+    eval::Evaluator GradientTuner::evaluator() const
+    {
+        eval::Evaluator e;
+        std::transform(params.cbegin(), params.cend(), e.evalTerms.begin(), [](double p) {
+            return static_cast<Eval>(std::lround(p));
+            });
+        return e;
+    }
 }
@@ -28,6 +28,12 @@ along with this program. If not, see <https://www.gnu.org/licenses/>.
 #include <random>
 #include <optional>
 #include <limits>
+#include <array>
+#include <span>
+
+#include "board.hpp"
+#include "dataset.hpp"
+#include "eval.hpp"
 
 namespace Tuning
 {
@@ -215,6 +221,53 @@ namespace Tuning
         }
         return best;
     }
+
+    using ScoredPositions = std::vector<std::pair<board::QBB, double>>;
+
+    // Replaces every position by the last position of its quiescence search PV under e, where
+    // the static evaluation equals the quiescence search score. Once resolved, an evaluator's
+    // error needs one static evaluation per position instead of a quiescence search. Results
+    // are flipped along with the side to move, and positions that end in mate are left out.
+    ScoredPositions quiet_leaves(const eval::Evaluator& e, std::span<const dataset::Record>);
+
+    // a training position reduced to what the linear error needs
+    struct TracedPosition
+    {
+        eval::EvalTrace trace;
+        double result = 0;
+    };
+
+    // traces every position in parallel, leaving out those no trace describes
+    std::vector<TracedPosition> trace_positions(const eval::Evaluator&, const ScoredPositions&);
+
+    // mean squared error of the traced evaluations with e's terms, without evaluating a single position
+    double linear_error(const std::vector<TracedPosition>&, const eval::Evaluator& e, double K);
+
+    // Adam on the evaluation terms. Every step computes the analytic gradient of the linear error
+    // in one parallel pass over the positions, instead of one pass per term and direction like
+    // local_search. The positions are held by reference so they can be traced again as terms change.
+    class GradientTuner
+    {
+    public:
+        using Params = std::array<double, 2 * eval::Evaluator::termCount>;
+    private:
+        const std::vector<TracedPosition>& positions;
+        const double K;
+        Params params{};
+        Params m{};
+        Params v{};
+        std::size_t steps = 0;
+
+        double evaluate(const eval::EvalTrace&) const;
+        Params gradient() const;
+    public:
+        GradientTuner(const std::vector<TracedPosition>& positions, const eval::Evaluator& start, double K);
+
+        double error() const;
+        void step(double learningRate);
+        // the terms rounded to what the evaluator stores
+        eval::Evaluator evaluator() const;
+    };
 }
 
 
@@ -29,6 +29,8 @@ along with this program. If not, see <https://www.gnu.org/licenses/>.
 #include <tuple>
 #include <locale>
 #include <numeric>
+#include <cmath>
+#include <algorithm>
 
 #include "uci.hpp"
 #include "board.hpp"
@@ -37,6 +39,7 @@ along with this program. If not, see <https://www.gnu.org/licenses/>.
 #include "constants.hpp"
 #include "divide.hpp"
 #include "tune.hpp"
+#include "dataset.hpp"
 #include "types.hpp"
 
 namespace uci
@@ -48,6 +51,14 @@ namespace uci
         uci_out << "id name " << UCIName << std::endl;
         uci_out << "id author " << UCIAuthor << std::endl;
         uci_out << "option name Hash type spin default 1 min 1 max 256" << std::endl;
+        uci_out << "option name MultiPV type spin default 1 min 1 max 256" << std::endl;
+        uci_out << "option name Ponder type check default false" << std::endl;
+        uci_out << "option name EvalFile type string default <empty>" << std::endl;
+        uci_out << "option name UseNNUE type check default false" << std::endl;
+        uci_out << "option name LMRBase type spin default " << std::lround(engine::searchParams.lmrBase * 100) << " min 0 max 300" << std::endl;
+        uci_out << "option name LMRDivisor type spin default " << std::lround(engine::searchParams.lmrDivisor * 100) << " min 50 max 800" << std::endl;
+        uci_out << "option name LMRHistoryDivisor type spin default " << engine::searchParams.lmrHistoryDivisor << " min 256 max 65536" << std::endl;
+        uci_out << "option name LazyMarginDivisor type spin default " << eval::Evaluator{}.lazyMarginDivisor << " min 1 max 64" << std::endl;
         uci_out << "uciok" << std::endl;
         uci_out.emit();
     }
@@ -81,7 +92,7 @@ namespace uci
                 {
                     initialized = true;
                 }
-                Tables::tt.clear();
+                Tables::tt.nextGeneration();
                 e.newGame();
             }
             if (UCIMessage[0] == "position" && UCIMessage.size() >= 2)
@@ -96,6 +107,9 @@ namespace uci
             }
             if (UCIMessage[0] == "stop")
                 UCIStopCommand();
+            // the search keeps running and switches to its normal time limits
+            if (UCIMessage[0] == "ponderhit")
+                SearchFlags::ponder.clear();
             if (UCIMessage[0] == "tune")
             {
                 Tune(std::stod(UCIMessage[1]), 
@@ -108,6 +122,14 @@ namespace uci
             {
                 Tune(UCIMessage[1]);
             }
+            if (UCIMessage[0] == "tune3")
+            {
+                Tune(UCIMessage[1], std::stoi(UCIMessage[2]));
+            }
+            if (UCIMessage[0] == "convert")
+            {
+                ConvertScoredPositions(UCIMessage[1], UCIMessage[2]);
+            }
         }
     }
 
@@ -176,6 +198,19 @@ namespace uci
                 ss.ponder = true;
             else if (i == "infinite")
                 ss.infiniteSearch = true;
+            else if (i == "searchmoves")
+            {
+                // the move list runs until the next token that isn't a move
+                auto isMove = [](const std::string& s) {
+                    return (s.size() == 4 || s.size() == 5)
+                        && s[0] >= 'a' && s[0] <= 'h' && s[1] >= '1' && s[1] <= '8'
+                        && s[2] >= 'a' && s[2] <= 'h' && s[3] >= '1' && s[3] <= '8';
+                };
+                for (std::size_t j = index + 1; j < command.size() && isMove(command[j]); ++j)
+                {
+                    ss.searchMoves.push_back(uciMove2boardMove(b, command[j]));
+                }
+            }
             else if (i == "perft")
             {
                 auto start = std::chrono::steady_clock::now();
@@ -188,8 +223,13 @@ namespace uci
             }
             ++index;
         }
+        ss.multiPV = multiPV;
         e.setSettings(ss);
 
+        if (ss.ponder)
+            SearchFlags::ponder.test_and_set();
+        else
+            SearchFlags::ponder.clear();
         SearchFlags::searching.test_and_set();
         auto tmp = std::async(&engine::Engine::rootSearch, &e, b, startTime);
         engineResult = std::move(tmp);
@@ -212,6 +252,54 @@ namespace uci
                     Tables::tt.resize( (1024*1024*std::stoi(command[index + 3])) / sizeof(Tables::Entry));
                     Tables::tt.clear();
                 }
+                else if (command[index + 1] == "MultiPV" && command[index + 2] == "value")
+                {
+                    multiPV = std::clamp<std::size_t>(std::stoi(command[index + 3]), 1, 256);
+                }
+                else if (command[index + 1] == "LMRBase" && command[index + 2] == "value")
+                {
+                    engine::searchParams.lmrBase = std::stoi(command[index + 3]) / 100.0;
+                    engine::initSearchTables();
+                }
+                else if (command[index + 1] == "LMRDivisor" && command[index + 2] == "value")
+                {
+                    engine::searchParams.lmrDivisor = std::stoi(command[index + 3]) / 100.0;
+                    engine::initSearchTables();
+                }
+                else if (command[index + 1] == "LMRHistoryDivisor" && command[index + 2] == "value")
+                {
+                    engine::searchParams.lmrHistoryDivisor = std::stoi(command[index + 3]);
+                }
+                else if (command[index + 1] == "LazyMarginDivisor" && command[index + 2] == "value")
+                {
+                    eval::Evaluator evaluator = e.getEvaluator();
+                    evaluator.lazyMarginDivisor = std::clamp(std::stoi(command[index + 3]), 1, 64);
+                    e.setEvaluator(evaluator);
+                }
+                else if (command[index + 1] == "EvalFile" && command[index + 2] == "value")
+                {
+                    // paths may contain spaces
+                    std::string filename = command.size() > index + 3 ? command[index + 3] : "";
+                    for (std::size_t j = index + 4; j < command.size(); ++j)
+                        filename += " " + command[j];
+                    network = nnue::Network::load(filename);
+                    if (!network)
+                    {
+                        uci_out << "info string could not load network " << filename << std::endl;
+                        uci_out.emit();
+                    }
+                    e.setEvaluator(useNNUE ? network : nullptr);
+                }
+                else if (command[index + 1] == "UseNNUE" && command[index + 2] == "value")
+                {
+                    useNNUE = command[index + 3] == "true";
+                    if (useNNUE && !network)
+                    {
+                        uci_out << "info string no network loaded, set EvalFile first" << std::endl;
+                        uci_out.emit();
+                    }
+                    e.setEvaluator(useNNUE ? network : nullptr);
+                }
             ++index;
         }
     }
@@ -250,30 +338,33 @@ namespace uci
     {
         TestPositions EPDSuite;
         EPDSuite.loadScoredPositions(filename);
-        
-        auto error = [&EPDSuite](eval::Evaluator ev, double k) {
-            double N = EPDSuite.scoredPositions.size();
+
+        // quiescence search is run once per position here and at every checkpoint,
+        // in between the error only needs the static evaluation of the leaves
+        Tuning::ScoredPositions leaves;
+        eval::PositionBatch leafBatch;
+        auto resolveLeaves = [&](const eval::Evaluator& ev) {
+            leaves = Tuning::quiet_leaves(ev, EPDSuite.scoredPositions());
+            leafBatch = eval::PositionBatch{};
+            for (const auto& [pos, score] : leaves)
+                leafBatch.push_back(pos);
+        };
+        resolveLeaves(eval::Evaluator{});
+
+        auto error = [&leaves, &leafBatch](eval::Evaluator ev, double k) {
+            std::vector<Eval> evals(leafBatch.size());
+            ev(leafBatch, evals);
             double sum = std::transform_reduce(std::execution::par,
-                EPDSuite.scoredPositions.cbegin(),
-                EPDSuite.scoredPositions.cend(),
+                leaves.cbegin(),
+                leaves.cend(),
+                evals.cbegin(),
                 0.0,
-                std::plus<>(), 
-                [&ev, &k](const auto& x) -> double {
-                    const auto& pos = x.first;
-                    const auto score = x.second;
-                    engine::SearchSettings ss;
-                    ss.quiet = true;
-                    ss.ignoreSearchFlags = true;
-                    engine::Engine eng{};
-                    eng.setEvaluator(ev);
-                    eng.setSettings(ss);
-                    eng.newGame();
-                    eng.newSearch(pos, std::chrono::steady_clock::now());
-                    SearchFlags::searching.test_and_set();
-                    double tmp = score - aux::sigmoid(k, eng.quiesceSearch(engine::rootMinBound, engine::rootMaxBound, 0));
+                std::plus<>(),
+                [k](const auto& x, Eval e) -> double {
+                    double tmp = x.second - aux::sigmoid(k, e);
                     return tmp * tmp;
                 });
-            return sum / N;
+            return sum / std::max<std::size_t>(leaves.size(), 1);
         };
 
         const double K = Tuning::find_best_K(eval::Evaluator{}, error);
@@ -282,17 +373,21 @@ namespace uci
 
         auto best = Tuning::local_search_one_iteration(eval::Evaluator{}, error, K);
 
-        double olderror = best.second;
+        double olderror = 0;
         
         do
         {
-            olderror = best.second;
+            const eval::Evaluator previous = best.first;
             for (std::size_t i = 0; i != 10; ++i)
             {
                 best = Tuning::local_search_one_iteration(best.first, error, K);
             }
             std::ofstream output{ std::string("finalevaluator.txt"), std::ios::app };
             output << best.first.asString();
+            // errors on different leaves aren't comparable, so the previous checkpoint is scored again
+            resolveLeaves(best.first);
+            olderror = error(previous, K);
+            best.second = error(best.first, K);
             uci_out << "error " << best.second << std::endl;
             uci_out.emit();
         } while (best.second < olderror);
@@ -300,6 +395,56 @@ namespace uci
         uci_out.emit();
     }
 
+    // Texel tuning of the static evaluation with Adam on evaluation traces
+    void UCIProtocol::Tune(std::string filename, std::size_t epochs)
+    {
+        // Adam's steps are about this many centipawns regardless of the gradient's size
+        constexpr double learningRate = 1.0;
+        // the traces freeze terms that scale others, such as king safety by material, and
+        // the quiet leaves depend on the terms too, so both are redone every checkpoint
+        constexpr std::size_t checkpointInterval = 100;
+
+        TestPositions EPDSuite;
+        EPDSuite.loadScoredPositions(filename);
+
+        auto positions = Tuning::trace_positions(eval::Evaluator{}, Tuning::quiet_leaves(eval::Evaluator{}, EPDSuite.scoredPositions()));
+        uci_out << "Positions count " << positions.size() << std::endl;
+
+        const double K = Tuning::find_best_K(eval::Evaluator{}, [&positions](const eval::Evaluator& ev, double k) {
+            return Tuning::linear_error(positions, ev, k);
+            });
+        uci_out << "best K " << K << std::endl;
+        uci_out.emit();
+
+        Tuning::GradientTuner tuner{ positions, eval::Evaluator{}, K };
+        for (std::size_t epoch = 1; epoch <= epochs; ++epoch)
+        {
+            tuner.step(learningRate);
+            if (epoch % checkpointInterval == 0 || epoch == epochs)
+            {
+                const auto best = tuner.evaluator();
+                std::ofstream output{ std::string("finalevaluator.txt"), std::ios::app };
+                output << best.asString();
+                positions = Tuning::trace_positions(best, Tuning::quiet_leaves(best, EPDSuite.scoredPositions()));
+                uci_out << "epoch " << epoch << " error " << tuner.error() << std::endl;
+                uci_out.emit();
+            }
+        }
+        uci_out << "done tuning" << std::endl;
+        uci_out.emit();
+    }
+
+    void UCIProtocol::ConvertScoredPositions(std::string epdFile, std::string binaryFile)
+    {
+        TestPositions EPDSuite;
+        EPDSuite.loadScoredPositions(epdFile);
+        if (dataset::write(binaryFile, EPDSuite.scoredPositions()))
+            uci_out << "converted " << EPDSuite.scoredPositions().size() << " positions" << std::endl;
+        else
+            uci_out << "info string could not write " << binaryFile << std::endl;
+        uci_out.emit();
+    }
+
     // we're assuming that the GUI isn't sending us invalid moves
     Move uciMove2boardMove(const board::QBB& b, const std::string& uciMove)
     {
@@ -366,6 +511,14 @@ namespace uci
 
     void TestPositions::loadScoredPositions(std::string filename)
     {
+        mappedRecords.emplace(filename);
+        if (*mappedRecords)
+        {
+            scoredRecords.clear();
+            return;
+        }
+        mappedRecords.reset();
+
         std::ifstream test{ filename };
         std::string input;
         while (std::getline(test, input))
@@ -386,24 +539,23 @@ namespace uci
                 auto first = pos[8].find_first_not_of(pgneq);
                 assert(pos[8][first] == '0' || pos[8][first] == '1');
                 double score = std::stod(pos[8].substr(first));
-                scoredPositions.push_back(std::make_pair(b, score));
+                scoredRecords.emplace_back(b, score);
             }
         }
     }
 
     std::uint64_t TestPositions::score(const eval::Evaluator& e) const
     {
-        engine::Engine eng;
         engine::SearchSettings ss;
         ss.maxDepth = 2;
         ss.quiet = true;
-        eng.setSettings(ss);
-        eng.setEvaluator(e);
+        // the genetic tuner scores its population in parallel, so the searches mustn't share the stop flag
+        ss.ignoreSearchFlags = true;
+        engine::EnginePool pool{ e, ss };
         std::uint64_t mistakes = 0;
         for (std::size_t count = 0; const auto& [pos, ml] : positions)
         {
-            eng.newGame();
-            SearchFlags::searching.test_and_set();
+            auto& eng = pool.engine();
             eng.rootSearch(pos, std::chrono::steady_clock::now());
             auto bestmove = eng.rootMoves[0].m;
             bool found = false;
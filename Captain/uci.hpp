@@ -24,9 +24,14 @@ along with this program. If not, see <https://www.gnu.org/licenses/>.
 #include <future>
 #include <syncstream>
 #include <chrono>
+#include <memory>
+#include <optional>
+#include <span>
 
 #include "board.hpp"
+#include "dataset.hpp"
 #include "engine.hpp"
+#include "nnue.hpp"
 #include "searchflags.hpp"
 #include "tables.hpp"
 #include "types.hpp"
@@ -47,10 +52,16 @@ namespace uci
         void UCISetOptionCommand(const std::vector<std::string>&);
         void Tune(double, double, std::size_t, std::size_t, std::string);
         void Tune(std::string);
+        void Tune(std::string, std::size_t epochs);
+        // scored EPD positions to the record format loadScoredPositions maps into memory
+        void ConvertScoredPositions(std::string epdFile, std::string binaryFile);
         std::osyncstream uci_out;
         std::string UCIName = "Captain v4.0";
         std::string UCIAuthor = "Narbeh Mouradian";
         bool initialized = false;
+        std::size_t multiPV = 1;
+        bool useNNUE = false;
+        std::shared_ptr<const nnue::Network> network;
         board::Board b;
         engine::Engine e;
         std::future<void> engineResult;
@@ -66,12 +77,23 @@ namespace uci
 
         std::vector<std::pair<board::QBB, BestMoveList>> positions;
 
-        std::vector<std::pair<board::QBB, double>> scoredPositions;
+        // scored EPD lines, or a file of records written by dataset::write mapped for as long as this lives
+        std::vector<dataset::Record> scoredRecords;
+        std::optional<dataset::MappedDataset> mappedRecords;
 
         void loadPositions(std::string filename);
 
+        // maps a record file, or else appends the file's scored EPD lines
         void loadScoredPositions(std::string filename);
 
+        // the loaded scored positions, read where they lie if they were mapped
+        std::span<const dataset::Record> scoredPositions() const noexcept
+        {
+            if (mappedRecords)
+                return mappedRecords->span();
+            return scoredRecords;
+        }
+
         std::uint64_t score(const eval::Evaluator& e) const;
     };
 }